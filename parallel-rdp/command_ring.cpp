@@ -25,6 +25,7 @@
 #include "rdp_device.hpp"
 #include "thread_id.hpp"
 #include <assert.h>
+#include <string.h>
 
 namespace RDP
 {
@@ -35,11 +36,13 @@ void CommandRing::init(
 		CommandProcessor *processor_, unsigned count)
 {
 	assert((count & (count - 1)) == 0);
+	assert(count > MaxCommandNumWords);
 	teardown_thread();
 	processor = processor_;
 	ring.resize(count);
-	write_count = 0;
-	read_count = 0;
+	write_count.store(0, std::memory_order_relaxed);
+	completed_count.store(0, std::memory_order_relaxed);
+	cached_completed_count = 0;
 #ifdef PARALLEL_RDP_SHADER_DIR
 	global_handles = std::move(global_handles_);
 #endif
@@ -60,27 +63,268 @@ CommandRing::~CommandRing()
 	teardown_thread();
 }
 
+// The waiting flags and the indices are all accessed with sequential consistency.
+// Either the waker observes the waiting flag, or the waiter observes the updated index when re-checking,
+// so a wakeup cannot be lost. The lock is only held to avoid racing against a thread which is about to park.
+void CommandRing::wake_producer()
+{
+	if (producer_waiting.load())
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		producer_cond.notify_one();
+	}
+}
+
+void CommandRing::wake_consumer()
+{
+	if (consumer_waiting.load())
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		consumer_cond.notify_one();
+	}
+}
+
 void CommandRing::drain()
 {
+	uint64_t target = write_count.load(std::memory_order_relaxed);
+	if (completed_count.load(std::memory_order_acquire) == target)
+		return;
+
 	std::unique_lock<std::mutex> holder{lock};
-	cond.wait(holder, [this]() {
-		return write_count == completed_count;
+	producer_waiting.store(true);
+	producer_cond.wait(holder, [this, target]() {
+		return completed_count.load() == target;
 	});
+	producer_waiting.store(false, std::memory_order_relaxed);
+}
+
+void CommandRing::wait_for_free_space(uint64_t required)
+{
+	if (required > cached_completed_count + ring.size())
+	{
+		cached_completed_count = completed_count.load(std::memory_order_acquire);
+		if (required > cached_completed_count + ring.size())
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			producer_waiting.store(true);
+			producer_cond.wait(holder, [this, required]() {
+				cached_completed_count = completed_count.load();
+				return required <= cached_completed_count + ring.size();
+			});
+			producer_waiting.store(false, std::memory_order_relaxed);
+		}
+	}
+}
+
+uint32_t *CommandRing::allocate_command(uint64_t &write, unsigned num_words)
+{
+	// Commands are always contiguous in the ring so the consumer can read them in-place.
+	size_t offset = write & (ring.size() - 1);
+	if (offset + num_words + 1 > ring.size())
+	{
+		ring[offset] = SkipMarker;
+		write += ring.size() - offset;
+		offset = 0;
+	}
+
+	ring[offset] = num_words;
+	write += num_words + 1;
+	// The shutdown terminator has no payload, and may sit in the last slot of the ring.
+	return ring.data() + offset + 1;
+}
+
+uint64_t CommandRing::write_command(uint64_t write, unsigned num_words, const uint32_t *words)
+{
+	uint32_t *payload = allocate_command(write, num_words);
+	if (num_words)
+		memcpy(payload, words, num_words * sizeof(uint32_t));
+	return write;
+}
+
+static inline unsigned get_ring_command_num_words(const uint32_t *words)
+{
+	unsigned op = (words[0] >> 24) & 63;
+	if (Op(op) == Op::MetaDrawTriangle)
+		return DecodedTriangleNumWords;
+	else
+		return get_command_num_words(op);
+}
+
+static inline size_t get_required_padding(uint64_t write, unsigned num_words, size_t size)
+{
+	size_t offset = write & (size - 1);
+	return offset + num_words + 1 > size ? size - offset : 0;
+}
+
+void CommandRing::publish(uint64_t write)
+{
+	write_count.store(write);
+	wake_consumer();
 }
 
 void CommandRing::enqueue_command(unsigned num_words, const uint32_t *words)
 {
+	uint64_t write = write_count.load(std::memory_order_relaxed);
+	wait_for_free_space(write + get_required_padding(write, num_words, ring.size()) + num_words + 1);
+	publish(write_command(write, num_words, words));
+}
+
+void CommandRing::enqueue_command_list(const uint32_t *words, size_t num_words)
+{
+	uint64_t write = write_count.load(std::memory_order_relaxed);
+	uint64_t published = write;
+
+	while (num_words)
+	{
+		unsigned command_words = get_ring_command_num_words(words);
+		// A list which ends with a partial command would otherwise be read past its end.
+		if (command_words > num_words)
+			break;
+
+		uint64_t required = write + get_required_padding(write, command_words, ring.size()) + command_words + 1;
+
+		// Let the consumer get started on what we have written so far before we potentially have to wait.
+		if (required > cached_completed_count + ring.size() && write != published)
+		{
+			publish(write);
+			published = write;
+		}
+
+		wait_for_free_space(required);
+		write = write_command(write, command_words, words);
+		words += command_words;
+		num_words -= command_words;
+	}
+
+	if (write != published)
+		publish(write);
+}
+
+size_t CommandRing::enqueue_display_list(const uint32_t *memory, uint32_t mask, uint32_t base, size_t num_words,
+                                         bool &sync_full)
+{
+	uint64_t write = write_count.load(std::memory_order_relaxed);
+	uint64_t published = write;
+	size_t offset = 0;
+
+	while (offset < num_words)
+	{
+		unsigned op = (memory[(base + offset) & mask] >> 24) & 63;
+		unsigned command_words = get_command_num_words(op);
+		if (offset + command_words > num_words)
+			break;
+
+		if (Op(op) == Op::SyncFull)
+			sync_full = true;
+
+		// Ops below 8 are no-ops in a display list, and would alias meta commands.
+		if (op >= unsigned(Op::FillTriangle))
+		{
+			uint64_t required = write + get_required_padding(write, command_words, ring.size()) + command_words + 1;
+
+			// Let the consumer get started on what we have written so far before we potentially have to wait.
+			if (required > cached_completed_count + ring.size() && write != published)
+			{
+				publish(write);
+				published = write;
+			}
+
+			wait_for_free_space(required);
+			uint32_t *payload = allocate_command(write, command_words);
+			for (unsigned i = 0; i < command_words; i++)
+				payload[i] = memory[(base + offset + i) & mask];
+		}
+
+		offset += command_words;
+	}
+
+	if (write != published)
+		publish(write);
+	return offset;
+}
+
+void CommandRing::set_idle_policy(const CommandRingIdlePolicy &policy)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	idle_policy = policy;
+	idle_policy_dirty.store(true, std::memory_order_relaxed);
+	// Make sure a parked RDP thread re-evaluates its timeout.
+	consumer_cond.notify_one();
+}
+
+CommandRingCounters CommandRing::get_counters() const
+{
+	CommandRingCounters counters;
+	counters.wakeups = wakeups.load(std::memory_order_relaxed);
+	counters.spurious_idles = spurious_idles.load(std::memory_order_relaxed);
+	counters.idle_submits = idle_submits.load(std::memory_order_relaxed);
+	return counters;
+}
+
+void CommandRing::record_idle_notification(bool submitted)
+{
+	if (submitted)
+		idle_submits.fetch_add(1, std::memory_order_relaxed);
+	else
+		spurious_idles.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Returns true when there is work to do, and false if the renderer should be notified about idleness.
+bool CommandRing::wait_for_work(uint64_t read, CommandRingIdlePolicy &policy, bool idle_notified)
+{
+	auto idle_start = std::chrono::steady_clock::now();
+
+	// Once we have gone idle, there is no point in burning CPU time anymore.
+	if (!idle_notified)
+	{
+		for (unsigned i = 0; i < policy.spin_count; i++)
+			if (write_count.load(std::memory_order_acquire) != read)
+				return true;
+
+		for (unsigned i = 0; i < policy.yield_count; i++)
+		{
+			std::this_thread::yield();
+			if (write_count.load(std::memory_order_acquire) != read)
+				return true;
+		}
+	}
+
 	std::unique_lock<std::mutex> holder{lock};
-	cond.wait(holder, [this, num_words]() {
-		return write_count + num_words + 1 <= read_count + ring.size();
-	});
+	consumer_waiting.store(true);
 
-	size_t mask = ring.size() - 1;
-	ring[write_count++ & mask] = num_words;
-	for (unsigned i = 0; i < num_words; i++)
-		ring[write_count++ & mask] = words[i];
+	for (;;)
+	{
+		if (idle_policy_dirty.load(std::memory_order_relaxed))
+		{
+			policy = idle_policy;
+			idle_policy_dirty.store(false, std::memory_order_relaxed);
+		}
+
+		bool has_work;
+		auto pred = [this, read]() { return write_count.load() != read; };
 
-	cond.notify_one();
+		if (!idle_notified)
+		{
+			auto deadline = idle_start + std::chrono::microseconds(policy.idle_kick_threshold_us);
+			has_work = consumer_cond.wait_until(holder, deadline, pred);
+			if (!has_work && std::chrono::steady_clock::now() < deadline)
+				continue;
+		}
+		else if (policy.park_timeout_us)
+			has_work = consumer_cond.wait_for(holder, std::chrono::microseconds(policy.park_timeout_us), pred);
+		else
+		{
+			// Work published before we started waiting must not be missed.
+			// Policy updates are picked up once new commands arrive.
+			consumer_cond.wait(holder, pred);
+			has_work = true;
+		}
+
+		consumer_waiting.store(false, std::memory_order_relaxed);
+		if (has_work)
+			wakeups.fetch_add(1, std::memory_order_relaxed);
+		return has_work;
+	}
 }
 
 void CommandRing::thread_loop()
@@ -94,42 +338,48 @@ void CommandRing::thread_loop()
 	global_handles.reset();
 #endif
 
-	std::vector<uint32_t> tmp_buffer;
-	tmp_buffer.reserve(64);
+	const uint32_t idle_word = uint32_t(Op::MetaIdle) << 24;
 	size_t mask = ring.size() - 1;
+	uint64_t read = completed_count.load(std::memory_order_relaxed);
+	CommandRingIdlePolicy policy;
+	bool idle_notified = false;
+
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		policy = idle_policy;
+		idle_policy_dirty.store(false, std::memory_order_relaxed);
+	}
 
 	for (;;)
 	{
-		bool is_idle = false;
+		if (write_count.load(std::memory_order_acquire) == read)
 		{
-			std::unique_lock<std::mutex> holder{lock};
-			if (cond.wait_for(holder, std::chrono::microseconds(500), [this]() { return write_count > read_count; }))
-			{
-				uint32_t num_words = ring[read_count++ & mask];
-				tmp_buffer.resize(num_words);
-				for (uint32_t i = 0; i < num_words; i++)
-					tmp_buffer[i] = ring[read_count++ & mask];
-			}
-			else
+			if (!wait_for_work(read, policy, idle_notified))
 			{
 				// If we don't receive commands at a steady pace,
 				// notify rendering thread that we should probably kick some work.
-				tmp_buffer.resize(1);
-				tmp_buffer[0] = uint32_t(Op::MetaIdle) << 24;
-				is_idle = true;
+				processor->enqueue_command_direct(1, &idle_word);
+				idle_notified = true;
+				continue;
 			}
 		}
 
-		if (tmp_buffer.empty())
-			break;
+		idle_notified = false;
 
-		processor->enqueue_command_direct(tmp_buffer.size(), tmp_buffer.data());
-		if (!is_idle)
+		uint32_t num_words = ring[read & mask];
+		if (num_words == SkipMarker)
 		{
-			std::lock_guard<std::mutex> holder{lock};
-			completed_count = read_count;
-			cond.notify_one();
+			read += ring.size() - (read & mask);
+			continue;
 		}
+
+		if (num_words == 0)
+			break;
+
+		processor->enqueue_command_direct(num_words, &ring[(read + 1) & mask]);
+		read += num_words + 1;
+		completed_count.store(read);
+		wake_producer();
 	}
 }
 }
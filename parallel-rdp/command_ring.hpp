@@ -25,6 +25,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <vector>
 
 #ifdef PARALLEL_RDP_SHADER_DIR
@@ -34,6 +35,37 @@
 namespace RDP
 {
 class CommandProcessor;
+
+// Controls how the RDP thread waits for new commands.
+// The defaults park immediately and notify the renderer every 500 us while idle.
+struct CommandRingIdlePolicy
+{
+	// Number of times the ring is polled before the thread starts yielding.
+	unsigned spin_count = 0;
+
+	// Number of times the thread yields before it parks.
+	unsigned yield_count = 0;
+
+	// How long the ring must have been empty before the renderer is notified that it should kick pending work.
+	unsigned idle_kick_threshold_us = 500;
+
+	// After the first idle notification, keep notifying the renderer at this interval while still idle.
+	// If 0, the thread parks until new commands arrive instead.
+	unsigned park_timeout_us = 500;
+};
+
+struct CommandRingCounters
+{
+	// Number of times the RDP thread had to be woken up from a parked state to process new commands.
+	uint64_t wakeups = 0;
+
+	// Number of idle notifications which did not lead to a submission.
+	uint64_t spurious_idles = 0;
+
+	// Number of submissions caused by idle notifications.
+	uint64_t idle_submits = 0;
+};
+
 class CommandRing
 {
 public:
@@ -47,18 +79,66 @@ public:
 
 	void enqueue_command(unsigned num_words, const uint32_t *words);
 
+	// words must only contain complete display list commands, or decoded triangles.
+	// Ops below FillTriangle are sized as meta commands, so raw display lists must be filtered first.
+	// Commands are published in batches, as many as can fit in the ring at a time.
+	void enqueue_command_list(const uint32_t *words, size_t num_words);
+
+	// Copies the complete commands of a display list in memory straight into the ring, skipping ops below FillTriangle.
+	// Word i of the list is read from memory[(base + i) & mask], so it can wrap around e.g. RSP DMEM.
+	// Returns the number of words consumed, and sets sync_full if a SyncFull was copied.
+	size_t enqueue_display_list(const uint32_t *memory, uint32_t mask, uint32_t base, size_t num_words,
+	                            bool &sync_full);
+
+	void set_idle_policy(const CommandRingIdlePolicy &policy);
+	CommandRingCounters get_counters() const;
+
+	// Called from the RDP thread when an idle notification has been processed.
+	void record_idle_notification(bool submitted);
+
 private:
 	CommandProcessor *processor = nullptr;
 	std::thread thr;
+
+	// The lock and condition variables are only used to park threads.
+	// Producer and consumer synchronize through the atomic indices alone.
 	std::mutex lock;
-	std::condition_variable cond;
+	std::condition_variable producer_cond;
+	std::condition_variable consumer_cond;
+	std::atomic_bool producer_waiting{false};
+	std::atomic_bool consumer_waiting{false};
 
 	std::vector<uint32_t> ring;
-	uint64_t write_count = 0;
-	uint64_t read_count = 0;
-	uint64_t completed_count = 0;
+
+	// Only written by producer.
+	std::atomic_uint64_t write_count{0};
+	uint64_t cached_completed_count = 0;
+
+	// Only written by consumer.
+	// Commands are consumed in-place, so ring space is only released once a command has completed.
+	std::atomic_uint64_t completed_count{0};
+
+	// Written by producer when a command would straddle the end of the ring.
+	// The consumer skips ahead to the start of the ring.
+	enum { SkipMarker = ~0u };
+
+	// Guarded by lock. The RDP thread picks up changes the next time it has to wait.
+	CommandRingIdlePolicy idle_policy;
+	std::atomic_bool idle_policy_dirty{false};
+
+	std::atomic_uint64_t wakeups{0};
+	std::atomic_uint64_t spurious_idles{0};
+	std::atomic_uint64_t idle_submits{0};
+
+	void wake_producer();
+	void wake_consumer();
+	void wait_for_free_space(uint64_t required);
+	uint32_t *allocate_command(uint64_t &write, unsigned num_words);
+	uint64_t write_command(uint64_t write, unsigned num_words, const uint32_t *words);
+	void publish(uint64_t write);
 
 	void thread_loop();
+	bool wait_for_work(uint64_t read, CommandRingIdlePolicy &policy, bool idle_notified);
 	void teardown_thread();
 #ifdef PARALLEL_RDP_SHADER_DIR
 	Granite::Global::GlobalManagersHandle global_handles;
@@ -0,0 +1,177 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "masked_memcpy.hpp"
+#include "bitops.hpp"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MASKED_MEMCPY_SSE2
+#if defined(__GNUC__)
+#include <immintrin.h>
+#define MASKED_MEMCPY_AVX2
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define MASKED_MEMCPY_NEON
+#endif
+
+namespace RDP
+{
+// Partial masks are rare, and mostly come from 8-bit or 16-bit writes next to untouched bytes.
+// They are copied with plain byte-granular stores. A blend would have to write back bytes
+// we do not own, and maskmove is a non-temporal store which is slow even for full masks.
+static inline void masked_copy_bits(uint8_t *dst, const uint8_t *data, uint32_t bits)
+{
+	Util::for_each_bit_range(bits, [&](unsigned index, unsigned count) {
+		memcpy(dst + index, data + index, count);
+	});
+}
+
+#ifdef MASKED_MEMCPY_SSE2
+static void masked_memcpy_sse2(uint8_t * __restrict dst,
+                               const uint8_t * __restrict data,
+                               const uint8_t * __restrict mask,
+                               size_t size)
+{
+	for (size_t i = 0; i < size; i += 16)
+	{
+		auto bits = uint32_t(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i))));
+		if (bits == 0xffffu)
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+		else if (bits)
+			masked_copy_bits(dst + i, data + i, bits);
+	}
+}
+#endif
+
+#ifdef MASKED_MEMCPY_AVX2
+__attribute__((target("avx2")))
+static void masked_memcpy_avx2(uint8_t * __restrict dst,
+                               const uint8_t * __restrict data,
+                               const uint8_t * __restrict mask,
+                               size_t size)
+{
+	for (size_t i = 0; i < size; i += 64)
+	{
+		auto lo = uint32_t(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i))));
+		auto hi = uint32_t(_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i + 32))));
+
+		if ((lo & hi) == ~0u)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+			                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32),
+			                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32)));
+		}
+		else if (lo | hi)
+		{
+			if (lo == ~0u)
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+				                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+			else if (lo)
+				masked_copy_bits(dst + i, data + i, lo);
+
+			if (hi == ~0u)
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i + 32),
+				                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32)));
+			else if (hi)
+				masked_copy_bits(dst + i + 32, data + i + 32, hi);
+		}
+	}
+}
+#endif
+
+#ifdef MASKED_MEMCPY_NEON
+static void masked_memcpy_neon(uint8_t * __restrict dst,
+                               const uint8_t * __restrict data,
+                               const uint8_t * __restrict mask,
+                               size_t size)
+{
+	for (size_t i = 0; i < size; i += 16)
+	{
+		uint8x16_t m = vld1q_u8(mask + i);
+		if (vminvq_u8(m) == 0xff)
+		{
+			vst1q_u8(dst + i, vld1q_u8(data + i));
+		}
+		else if (vmaxvq_u8(m) != 0)
+		{
+			// Narrow each byte to a nibble to get a 64-bit mask, then gather it back to one bit per byte.
+			uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+			uint32_t bits = 0;
+			for (unsigned j = 0; j < 16; j++)
+				bits |= uint32_t((nibbles >> (4 * j)) & 1) << j;
+			masked_copy_bits(dst + i, data + i, bits);
+		}
+	}
+}
+#endif
+
+#if !defined(MASKED_MEMCPY_SSE2) && !defined(MASKED_MEMCPY_NEON)
+static void masked_memcpy_scalar(uint8_t * __restrict dst,
+                                 const uint8_t * __restrict data,
+                                 const uint8_t * __restrict mask,
+                                 size_t size)
+{
+	for (size_t i = 0; i < size; i += 16)
+	{
+		uint32_t bits = 0;
+		for (unsigned j = 0; j < 16; j++)
+			bits |= uint32_t(mask[i + j] != 0) << j;
+
+		if (bits == 0xffffu)
+			memcpy(dst + i, data + i, 16);
+		else if (bits)
+			masked_copy_bits(dst + i, data + i, bits);
+	}
+}
+#endif
+
+using MaskedMemcpyFunc = void (*)(uint8_t * __restrict, const uint8_t * __restrict, const uint8_t * __restrict, size_t);
+
+static MaskedMemcpyFunc select_masked_memcpy()
+{
+#ifdef MASKED_MEMCPY_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return masked_memcpy_avx2;
+#endif
+
+#if defined(MASKED_MEMCPY_SSE2)
+	return masked_memcpy_sse2;
+#elif defined(MASKED_MEMCPY_NEON)
+	return masked_memcpy_neon;
+#else
+	return masked_memcpy_scalar;
+#endif
+}
+
+void masked_memcpy(uint8_t * __restrict dst,
+                   const uint8_t * __restrict data,
+                   const uint8_t * __restrict mask,
+                   size_t size)
+{
+	static const MaskedMemcpyFunc func = select_masked_memcpy();
+	func(dst, data, mask, size);
+}
+}
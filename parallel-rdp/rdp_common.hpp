@@ -42,6 +42,9 @@ enum class Op
 	MetaFlush = 2,
 	MetaIdle = 3,
 	MetaSetQuirks = 4,
+	MetaDrawTriangle = 5,
+	MetaSetFlushPolicy = 6,
+	MetaSnapshotFrameStatistics = 7,
 
 	FillTriangle = 0x08,
 	FillZBufferTriangle = 0x09,
@@ -80,6 +83,31 @@ enum class Op
 	SetColorImage = 0x3f
 };
 
+// Number of 32-bit words a command occupies in a display list, including the command word itself.
+// Meta commands are never part of a display list and are not covered here.
+static inline unsigned get_command_num_words(unsigned op)
+{
+	if (op >= unsigned(Op::FillTriangle) && op <= unsigned(Op::ShadeTextureZBufferTriangle))
+	{
+		// Edge coefficients, followed by optional shade, texture and depth coefficients.
+		unsigned num_words = 8;
+		if (op & 4)
+			num_words += 16;
+		if (op & 2)
+			num_words += 16;
+		if (op & 1)
+			num_words += 4;
+		return num_words;
+	}
+	else if (op == unsigned(Op::TextureRectangle) || op == unsigned(Op::TextureRectangleFlip))
+		return 4;
+	else
+		return 2;
+}
+
+// Largest command in a display list, i.e. ShadeTextureZBufferTriangle.
+static constexpr unsigned MaxCommandNumWords = 44;
+
 enum class RGBMul : uint8_t
 {
 	Combined = 0,
@@ -174,7 +174,9 @@ struct InstanceIndices
 	uint8_t static_index;
 	uint8_t depth_blend_index;
 	uint8_t tile_instance_index;
-	uint8_t padding[5];
+	uint8_t target_index;
+	// Number of culled primitives before this one in the render pass, which still advance the noise seed.
+	uint32_t noise_offset;
 	uint8_t tile_indices[8];
 };
 static_assert((sizeof(InstanceIndices) & 15) == 0, "InstanceIndices must be aligned to 16 bytes.");
@@ -263,18 +265,42 @@ public:
 			if (memcmp(&elements[cached_index], &t, sizeof(T)) == 0)
 				return unsigned(cached_index);
 
-		for (int i = int(count) - 1; i >= 0; i--)
+		// Small caches are faster to scan than to hash.
+		if (count <= LinearScanCount)
 		{
-			if (memcmp(&elements[i], &t, sizeof(T)) == 0)
+			for (int i = int(count) - 1; i >= 0; i--)
 			{
-				cached_index = i;
-				return unsigned(i);
+				if (memcmp(&elements[i], &t, sizeof(T)) == 0)
+				{
+					cached_index = i;
+					return unsigned(i);
+				}
 			}
 		}
 
+		// Open addressing with linear probing. The table is never more than half full.
+		uint64_t hash = hash_state(t);
+		unsigned slot = unsigned(hash) & (HashTableSize - 1);
+		while (count > LinearScanCount && hash_table[slot])
+		{
+			unsigned index = hash_table[slot] - 1u;
+			if (hashes[index] == hash && memcmp(&elements[index], &t, sizeof(T)) == 0)
+			{
+				cached_index = int(index);
+				return index;
+			}
+			slot = (slot + 1) & (HashTableSize - 1);
+		}
+
+		// Elements are always indexed, so lookups can switch to the hash table at any fill level.
+		while (hash_table[slot])
+			slot = (slot + 1) & (HashTableSize - 1);
+
 		assert(count < N);
 		memcpy(elements + count, &t, sizeof(T));
+		hashes[count] = hash;
 		unsigned ret = count++;
+		hash_table[slot] = uint16_t(ret + 1);
 		cached_index = int(ret);
 		return ret;
 	}
@@ -303,6 +329,7 @@ public:
 	{
 		count = 0;
 		cached_index = -1;
+		memset(hash_table, 0, sizeof(hash_table));
 	}
 
 	bool empty() const
@@ -311,9 +338,28 @@ public:
 	}
 
 private:
+	static_assert((N & (N - 1)) == 0, "N must be a power of two.");
+	static_assert(N < 0x8000, "N is too large for 16-bit hash table entries.");
+	static_assert((sizeof(T) & 7) == 0, "State must be a multiple of 8 bytes.");
+	enum { HashTableSize = 2 * N, LinearScanCount = 8 };
+
+	static uint64_t hash_state(const T &t)
+	{
+		// States are small PODs, so a simple multiplicative hash over 64-bit words is plenty.
+		uint64_t words[sizeof(T) / sizeof(uint64_t)];
+		memcpy(words, &t, sizeof(T));
+
+		uint64_t h = 0xcbf29ce484222325ull;
+		for (auto w : words)
+			h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+		return h ^ (h >> 29);
+	}
+
 	unsigned count = 0;
 	int cached_index = -1;
 	T elements[N];
+	uint64_t hashes[N];
+	uint16_t hash_table[HashTableSize] = {};
 };
 
 template <typename T, unsigned N>
@@ -322,13 +368,29 @@ class StreamCache
 public:
 	void add(const T &t)
 	{
-		assert(count < N);
-		memcpy(&elements[count++], &t, sizeof(T));
+		assert(count < capacity);
+		memcpy(&storage[count++], &t, sizeof(T));
+	}
+
+	// Redirects writes to external memory with room for capacity elements, e.g. a persistently mapped upload buffer.
+	// Such memory is likely write-combined, so the cache is never read back.
+	// nullptr restores the inline storage. The cache must be empty.
+	void set_storage(T *storage_)
+	{
+		assert(count == 0);
+		storage = storage_ ? storage_ : elements;
+	}
+
+	// Allows limiting the cache below N at runtime.
+	void set_capacity(unsigned capacity_)
+	{
+		assert(capacity_ <= N);
+		capacity = capacity_;
 	}
 
 	bool full() const
 	{
-		return count == N;
+		return count == capacity;
 	}
 
 	unsigned size() const
@@ -343,7 +405,16 @@ public:
 
 	const T *data() const
 	{
-		return elements;
+		return storage;
+	}
+
+	// Appends num_elements which the caller fills in, e.g. from several threads.
+	T *allocate(unsigned num_elements)
+	{
+		assert(count + num_elements <= capacity);
+		T *ret = storage + count;
+		count += num_elements;
+		return ret;
 	}
 
 	void reset()
@@ -358,33 +429,52 @@ public:
 
 private:
 	unsigned count = 0;
+	unsigned capacity = N;
 	T elements[N];
+	T *storage = elements;
 };
 
 namespace Limits
 {
-constexpr unsigned MaxPrimitives = 256;
+// Upper bound. The number of primitives in a render pass is selected at runtime, see RendererOptions.
+// Binning uses one bit per group of 32 primitives in a 32-bit coarse mask, so this cannot be increased further.
+constexpr unsigned MaxPrimitives = 1024;
 constexpr unsigned MaxStaticRasterizationStates = 64;
 constexpr unsigned MaxDepthBlendStates = 64;
 constexpr unsigned MaxTileInfoStates = 256;
 constexpr unsigned NumSyncStates = 32;
+// Per render pass buffers are sub-allocated from rings which fit this many worst-case render passes.
+constexpr unsigned RenderBufferRingPasses = 8;
 constexpr unsigned MaxNumTiles = 8;
 constexpr unsigned MaxTMEMInstances = 256;
 constexpr unsigned MaxSpanSetups = 32 * 1024;
 constexpr unsigned MaxWidth = 1024;
 constexpr unsigned MaxHeight = 1024;
 constexpr unsigned MaxTileInstances = 0x8000;
+constexpr unsigned MaxRenderPassTargets = 4;
 }
 
 namespace ImplementationConstants
 {
 constexpr unsigned DefaultWorkgroupSize = 64;
+constexpr unsigned DefaultMaxPrimitives = 256;
 
 constexpr unsigned TileWidth = 8;
 constexpr unsigned TileHeight = 8;
 constexpr unsigned MaxTilesX = Limits::MaxWidth / TileWidth;
 constexpr unsigned MaxTilesY = Limits::MaxHeight / TileHeight;
-constexpr unsigned IncoherentPageSize = 1024;
+// Granularity of coherency between host and GPU RDRAM without VK_EXT_external_memory_host.
+// The page size is selected at runtime within these bounds, see RendererOptions::incoherent_page_size.
+constexpr unsigned MinIncoherentPageSize = 256;
+constexpr unsigned MaxIncoherentPageSize = 16 * 1024;
+// The initial page size splits RDRAM into at most this many pages.
+constexpr unsigned TargetIncoherentPages = 4096;
+// Adapting the page size is considered once per this many render pass flushes.
+constexpr unsigned IncoherentPageSizeAdaptInterval = 256;
+// The page size is doubled if flushes read more pages than this on average, with little over-fetch.
+constexpr unsigned TargetIncoherentPagesPerFlush = 256;
+// Workgroup size used to resolve or clear a page. Larger pages are looped over.
+constexpr unsigned MaxIncoherentPageWorkgroupSize = 256;
 constexpr unsigned MaxPendingRenderPassesBeforeFlush = 8;
 constexpr unsigned MinimumPrimitivesForIdleFlush = 32;
 constexpr unsigned MinimumRenderPassesForIdleFlush = 2;
@@ -21,12 +21,11 @@
  */
 
 #include "rdp_device.hpp"
+#include "masked_memcpy.hpp"
 #include "rdp_common.hpp"
 #include <chrono>
-
-#ifdef __SSE2__
-#include <emmintrin.h>
-#endif
+#include <algorithm>
+#include <string.h>
 
 #ifndef PARALLEL_RDP_SHADER_DIR
 #include "shaders/slangmosh.hpp"
@@ -44,11 +43,39 @@ namespace RDP
 CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
                                    size_t rdram_offset_, size_t rdram_size_, size_t hidden_rdram_size,
                                    CommandProcessorFlags flags_)
-	: device(device_), rdram_offset(rdram_offset_), rdram_size(rdram_size_), flags(flags_), renderer(*this),
+	: CommandProcessor(device_, nullptr, rdram_ptr, rdram_offset_, rdram_size_, hidden_rdram_size, flags_)
+{
+}
+
+CommandProcessor::CommandProcessor(SharedRDPContext &context_, void *rdram_ptr,
+                                   size_t rdram_offset_, size_t rdram_size_, size_t hidden_rdram_size,
+                                   CommandProcessorFlags flags_)
+	: CommandProcessor(context_.get_device(), &context_, rdram_ptr, rdram_offset_, rdram_size_, hidden_rdram_size, flags_)
+{
+}
+
+// Number of helper threads for a WorkerPool, which can be overridden with env.
+static unsigned get_num_helper_threads(const char *env)
+{
+	// The thread which submits the work participates as well, so only a few helpers are needed.
+	unsigned num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	num_threads = std::min((num_threads + 3) / 4, 3u);
+	if (const char *value = getenv(env))
+		num_threads = unsigned(strtoul(value, nullptr, 0));
+	return num_threads;
+}
+
+CommandProcessor::CommandProcessor(Vulkan::Device &device_, SharedRDPContext *context_, void *rdram_ptr,
+                                   size_t rdram_offset_, size_t rdram_size_, size_t hidden_rdram_size,
+                                   CommandProcessorFlags flags_)
+	: device(device_), rdram_offset(rdram_offset_), rdram_size(rdram_size_), flags(flags_),
+	  owned_context(context_ ? nullptr : new SharedRDPContext(device_)),
+	  context(context_ ? context_ : owned_context.get()),
+	  renderer(*this),
 #ifdef PARALLEL_RDP_SHADER_DIR
-	  timeline_worker(Granite::Global::create_thread_context(), FenceExecutor{&device, &thread_timeline_value})
+	  timeline_worker(Granite::Global::create_thread_context(), FenceExecutor{&device, &thread_timeline_value, get_num_helper_threads("PARALLEL_RDP_READBACK_THREADS")})
 #else
-	  timeline_worker(FenceExecutor{&device, &thread_timeline_value})
+	  timeline_worker(FenceExecutor{&device, &thread_timeline_value, get_num_helper_threads("PARALLEL_RDP_READBACK_THREADS")})
 #endif
 {
 	BufferCreateInfo info = {};
@@ -141,6 +168,9 @@ CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
 			LOGI("Will measure stall timings.\n");
 	}
 
+	if (const char *env = getenv("PARALLEL_RDP_STATE_FILTER"))
+		filter_redundant_state = strtol(env, nullptr, 0) > 0;
+
 	if (const char *env = getenv("PARALLEL_RDP_SINGLE_THREADED_COMMAND"))
 	{
 		single_threaded_processing = strtol(env, nullptr, 0) > 0;
@@ -148,6 +178,17 @@ CommandProcessor::CommandProcessor(Vulkan::Device &device_, void *rdram_ptr,
 			LOGI("Will use single threaded command processing.\n");
 	}
 
+	bool parallel_decode = (flags & COMMAND_PROCESSOR_FLAG_PARALLEL_TRIANGLE_DECODE_BIT) != 0;
+	if (const char *env = getenv("PARALLEL_RDP_PARALLEL_DECODE"))
+		parallel_decode = strtol(env, nullptr, 0) > 0;
+
+	if (parallel_decode && !single_threaded_processing)
+	{
+		unsigned num_threads = get_num_helper_threads("PARALLEL_RDP_DECODE_THREADS");
+		decode_pool.reset(new WorkerPool(num_threads));
+		LOGI("Will decode triangles ahead of command thread with %u helper threads.\n", num_threads);
+	}
+
 	if (!single_threaded_processing)
 	{
 		ring.init(
@@ -169,10 +210,23 @@ CommandProcessor::~CommandProcessor()
 void CommandProcessor::begin_frame_context()
 {
 	flush();
+
+	// Statistics are written by the command thread, which can run idle work at any time,
+	// so the snapshot has to be taken in order on that thread.
+	const uint32_t words[1] = {
+		uint32_t(Op::MetaSnapshotFrameStatistics) << 24,
+	};
+	enqueue_command_inner(1, words);
+
 	drain_command_ring();
 	device.next_frame_context();
 }
 
+const FrameStatistics &CommandProcessor::get_frame_statistics() const
+{
+	return last_frame_stats;
+}
+
 void CommandProcessor::init_renderer()
 {
 	if (!rdram)
@@ -182,6 +236,7 @@ void CommandProcessor::init_renderer()
 	}
 
 	renderer.set_device(&device);
+	renderer.set_shared_context(context);
 	renderer.set_rdram(rdram.get(), host_rdram, rdram_offset, rdram_size, is_host_coherent);
 	renderer.set_hidden_rdram(hidden_rdram.get());
 	renderer.set_tmem(tmem.get());
@@ -197,29 +252,117 @@ void CommandProcessor::init_renderer()
 	if (factor != 1)
 		LOGI("Enabling upscaling: %ux.\n", factor);
 
+	unsigned max_primitives = ImplementationConstants::DefaultMaxPrimitives;
+	if (flags & COMMAND_PROCESSOR_FLAG_PRIMITIVE_BATCH_1024_BIT)
+		max_primitives = 1024;
+	else if (flags & COMMAND_PROCESSOR_FLAG_PRIMITIVE_BATCH_512_BIT)
+		max_primitives = 512;
+
+	if (const char *env = getenv("PARALLEL_RDP_PRIMITIVE_BATCH"))
+	{
+		max_primitives = unsigned(strtoul(env, nullptr, 0));
+		if (max_primitives != 256 && max_primitives != 512 && max_primitives != 1024)
+		{
+			LOGW("PARALLEL_RDP_PRIMITIVE_BATCH must be 256, 512 or 1024, ignoring %s.\n", env);
+			max_primitives = ImplementationConstants::DefaultMaxPrimitives;
+		}
+	}
+
+	if (max_primitives != ImplementationConstants::DefaultMaxPrimitives)
+		LOGI("Using %u primitives per render pass.\n", max_primitives);
+
+	unsigned max_render_pass_targets = 1;
+	if (flags & COMMAND_PROCESSOR_FLAG_MULTI_TARGET_RENDER_PASS_BIT)
+		max_render_pass_targets = Limits::MaxRenderPassTargets;
+
+	if (const char *env = getenv("PARALLEL_RDP_RENDER_PASS_TARGETS"))
+	{
+		max_render_pass_targets = unsigned(strtoul(env, nullptr, 0));
+		if (max_render_pass_targets == 0 || max_render_pass_targets > Limits::MaxRenderPassTargets)
+		{
+			LOGW("PARALLEL_RDP_RENDER_PASS_TARGETS must be 1 to %u, ignoring %s.\n",
+			     Limits::MaxRenderPassTargets, env);
+			max_render_pass_targets = 1;
+		}
+	}
+
+	if (max_render_pass_targets != 1)
+		LOGI("Using up to %u framebuffers per render pass.\n", max_render_pass_targets);
+
+	bool cull_empty_primitives = true;
+	if (const char *env = getenv("PARALLEL_RDP_CULL_PRIMITIVES"))
+		cull_empty_primitives = strtol(env, nullptr, 0) > 0;
+
+	unsigned derived_setup_threads = 0;
+	if (const char *env = getenv("PARALLEL_RDP_DERIVED_SETUP_THREADS"))
+		derived_setup_threads = unsigned(strtoul(env, nullptr, 0));
+
+	if (derived_setup_threads)
+		LOGI("Building derived primitive state with %u helper threads.\n", derived_setup_threads);
+
+	bool track_dirty_pages = (flags & COMMAND_PROCESSOR_FLAG_DIRTY_PAGE_TRACKING_BIT) != 0;
+	if (const char *env = getenv("PARALLEL_RDP_DIRTY_PAGE_TRACKING"))
+		track_dirty_pages = strtol(env, nullptr, 0) > 0;
+
+	unsigned incoherent_page_size = 0;
+	if (flags & COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_16K_BIT)
+		incoherent_page_size = 16 * 1024;
+	else if (flags & COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_4K_BIT)
+		incoherent_page_size = 4 * 1024;
+	else if (flags & COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_1K_BIT)
+		incoherent_page_size = 1024;
+	else if (flags & COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_256_BIT)
+		incoherent_page_size = 256;
+
+	if (const char *env = getenv("PARALLEL_RDP_INCOHERENT_PAGE_SIZE"))
+	{
+		auto env_page_size = unsigned(strtoul(env, nullptr, 0));
+		if (env_page_size < ImplementationConstants::MinIncoherentPageSize ||
+		    env_page_size > ImplementationConstants::MaxIncoherentPageSize ||
+		    (env_page_size & (env_page_size - 1)) != 0)
+		{
+			LOGW("PARALLEL_RDP_INCOHERENT_PAGE_SIZE must be a power of two from %u to %u, ignoring %s.\n",
+			     ImplementationConstants::MinIncoherentPageSize, ImplementationConstants::MaxIncoherentPageSize, env);
+		}
+		else
+			incoherent_page_size = env_page_size;
+	}
+
+	if (incoherent_page_size && !is_host_coherent)
+		LOGI("Using %u byte pages for RDRAM coherency.\n", incoherent_page_size);
+
 	RendererOptions opts;
 	opts.upscaling_factor = factor;
+	opts.cull_empty_primitives = cull_empty_primitives;
+	opts.derived_setup_threads = derived_setup_threads;
+	opts.track_dirty_pages = track_dirty_pages;
+	opts.incoherent_page_size = incoherent_page_size;
+	opts.max_primitives = max_primitives;
+	opts.max_render_pass_targets = max_render_pass_targets;
 	opts.super_sampled_readback = (flags & COMMAND_PROCESSOR_FLAG_SUPER_SAMPLED_READ_BACK_BIT) != 0;
 	opts.super_sampled_readback_dither = (flags & COMMAND_PROCESSOR_FLAG_SUPER_SAMPLED_DITHER_BIT) != 0;
 
 	is_supported = renderer.init_renderer(opts);
 
 	vi.set_device(&device);
+	vi.set_shared_context(context);
 	vi.set_rdram(rdram.get(), rdram_offset, rdram_size);
 	vi.set_hidden_rdram(hidden_rdram.get());
 	vi.set_renderer(&renderer);
 
 #ifndef PARALLEL_RDP_SHADER_DIR
-	Vulkan::ResourceLayout layout;
-	shader_bank.reset(new ShaderBank(device, layout, [&](const char *name, const char *define) -> int {
+	auto *shader_bank = context->request_shader_bank([&](const char *name, const char *define) -> int {
 		if (strncmp(name, "vi_", 3) == 0)
 			return vi.resolve_shader_define(name, define);
 		else
 			return renderer.resolve_shader_define(name, define);
-	}));
-	renderer.set_shader_bank(shader_bank.get());
-	vi.set_shader_bank(shader_bank.get());
+	});
+	renderer.set_shader_bank(shader_bank);
+	vi.set_shader_bank(shader_bank);
 #endif
+
+	if (is_supported)
+		renderer.precompile_rasterizer_variants();
 }
 
 bool CommandProcessor::device_is_supported() const
@@ -265,9 +408,8 @@ void CommandProcessor::op_sync_full(const uint32_t *)
 	renderer.flush_and_signal();
 }
 
-void CommandProcessor::decode_triangle_setup(TriangleSetup &setup, const uint32_t *words) const
+static void decode_triangle_setup(TriangleSetup &setup, const uint32_t *words, bool copy_cycle, bool native_texture_lod)
 {
-	bool copy_cycle = (static_state.flags & RASTERIZATION_COPY_BIT) != 0;
 	bool flip = (words[0] & 0x800000u) != 0;
 	bool sign_dxhdy = (words[5] & 0x80000000u) != 0;
 	bool do_offset = flip == sign_dxhdy;
@@ -275,7 +417,7 @@ void CommandProcessor::decode_triangle_setup(TriangleSetup &setup, const uint32_
 	setup.flags |= flip ? TRIANGLE_SETUP_FLIP_BIT : 0;
 	setup.flags |= do_offset ? TRIANGLE_SETUP_DO_OFFSET_BIT : 0;
 	setup.flags |= copy_cycle ? TRIANGLE_SETUP_SKIP_XFRAC_BIT : 0;
-	setup.flags |= quirks.u.options.native_texture_lod ? TRIANGLE_SETUP_NATIVE_LOD_BIT : 0;
+	setup.flags |= native_texture_lod ? TRIANGLE_SETUP_NATIVE_LOD_BIT : 0;
 
 	setup.tile = (words[0] >> 16) & 63;
 
@@ -293,6 +435,13 @@ void CommandProcessor::decode_triangle_setup(TriangleSetup &setup, const uint32_
 	setup.dxmdy = sext<28>(words[7] >> 2) >> 1;
 }
 
+void CommandProcessor::decode_triangle_setup(TriangleSetup &setup, const uint32_t *words) const
+{
+	RDP::decode_triangle_setup(setup, words,
+	                           (static_state.flags & RASTERIZATION_COPY_BIT) != 0,
+	                           quirks.u.options.native_texture_lod);
+}
+
 static void decode_tex_setup(AttributeSetup &attr, const uint32_t *words)
 {
 	attr.s = (words[0] & 0xffff0000u) | ((words[4] >> 16) & 0x0000ffffu);
@@ -343,6 +492,40 @@ static void decode_z_setup(AttributeSetup &attr, const uint32_t *words)
 	attr.dzdy = words[3];
 }
 
+// Equivalent to the op_*_triangle handlers.
+static void encode_decoded_triangle(uint32_t *record, const uint32_t *words, bool copy_cycle, bool native_texture_lod)
+{
+	TriangleSetup setup = {};
+	AttributeSetup attr = {};
+	unsigned op = (words[0] >> 24) & 63;
+	decode_triangle_setup(setup, words, copy_cycle, native_texture_lod);
+
+	unsigned offset = 8;
+	if (op & 4)
+	{
+		decode_rgba_setup(attr, words + offset);
+		offset += 16;
+	}
+
+	if (op & 2)
+	{
+		decode_tex_setup(attr, words + offset);
+		offset += 16;
+	}
+
+	if (op & 1)
+		decode_z_setup(attr, words + offset);
+
+	record[0] = uint32_t(Op::MetaDrawTriangle) << 24;
+	memcpy(record + 1, &setup, sizeof(setup));
+	memcpy(record + 1 + sizeof(setup) / sizeof(uint32_t), &attr, sizeof(attr));
+}
+
+static bool op_is_triangle(unsigned op)
+{
+	return op >= unsigned(Op::FillTriangle) && op <= unsigned(Op::ShadeTextureZBufferTriangle);
+}
+
 void CommandProcessor::op_fill_triangle(const uint32_t *words)
 {
 	TriangleSetup setup = {};
@@ -867,12 +1050,97 @@ void CommandProcessor::enqueue_command_inner(unsigned num_words, const uint32_t
 {
 	if (single_threaded_processing)
 		enqueue_command_direct(num_words, words);
+	else if (decode_pool)
+		enqueue_command_decoded(num_words, words);
+	else
+		ring.enqueue_command(num_words, words);
+}
+
+void CommandProcessor::enqueue_command_decoded(unsigned num_words, const uint32_t *words)
+{
+	unsigned op = (words[0] >> 24) & 63;
+	if (op_is_triangle(op))
+	{
+		uint32_t record[DecodedTriangleNumWords];
+		encode_decoded_triangle(record, words, decode_copy_cycle, decode_native_texture_lod);
+		ring.enqueue_command(DecodedTriangleNumWords, record);
+	}
 	else
+	{
+		if (Op(op) == Op::SetOtherModes)
+		{
+			decode_copy_cycle = CycleType((words[0] >> 20) & 3) == CycleType::Copy;
+		}
+		else if (Op(op) == Op::MetaSetQuirks)
+		{
+			Quirks decode_quirks;
+			decode_quirks.u.words[0] = words[1];
+			decode_native_texture_lod = decode_quirks.u.options.native_texture_lod;
+		}
+
 		ring.enqueue_command(num_words, words);
+	}
+}
+
+void CommandProcessor::enqueue_command_list_decoded(const uint32_t *words, size_t num_words)
+{
+	// Bounds the latency before the command thread can start working.
+	constexpr size_t MaxTrianglesPerBatch = 1024;
+	constexpr unsigned TrianglesPerTask = 64;
+
+	while (num_words)
+	{
+		decode_jobs.clear();
+		decoded_commands.clear();
+
+		while (num_words && decode_jobs.size() < MaxTrianglesPerBatch)
+		{
+			unsigned op = (words[0] >> 24) & 63;
+			unsigned command_words = get_command_num_words(op);
+
+			if (op < unsigned(Op::FillTriangle))
+			{
+				// Would alias meta commands once in the ring, e.g. MetaDrawTriangle.
+			}
+			else if (op_is_triangle(op))
+			{
+				decode_jobs.push_back({ words, decoded_commands.size(), decode_copy_cycle });
+				decoded_commands.resize(decoded_commands.size() + DecodedTriangleNumWords);
+			}
+			else
+			{
+				if (Op(op) == Op::SetOtherModes)
+					decode_copy_cycle = CycleType((words[0] >> 20) & 3) == CycleType::Copy;
+				decoded_commands.insert(decoded_commands.end(), words, words + command_words);
+			}
+
+			words += command_words;
+			num_words -= command_words;
+		}
+
+		unsigned num_tasks = unsigned((decode_jobs.size() + TrianglesPerTask - 1) / TrianglesPerTask);
+		bool native_texture_lod = decode_native_texture_lod;
+		decode_pool->run(num_tasks, [&](unsigned task) {
+			size_t begin = task * TrianglesPerTask;
+			size_t end = std::min<size_t>(begin + TrianglesPerTask, decode_jobs.size());
+			for (size_t i = begin; i < end; i++)
+			{
+				auto &job = decode_jobs[i];
+				encode_decoded_triangle(decoded_commands.data() + job.offset, job.words,
+				                        job.copy_cycle, native_texture_lod);
+			}
+		});
+
+		ring.enqueue_command_list(decoded_commands.data(), decoded_commands.size());
+	}
 }
 
 void CommandProcessor::enqueue_command(unsigned num_words, const uint32_t *words)
 {
+	// Ops below 8 are no-ops in a display list, and would alias meta commands.
+	if (((words[0] >> 24) & 63) < unsigned(Op::FillTriangle))
+		return;
+
 	if (dump_writer && !dump_in_command_list)
 	{
 		wait_for_timeline(signal_timeline());
@@ -896,6 +1164,216 @@ void CommandProcessor::enqueue_command(unsigned num_words, const uint32_t *words
 	}
 }
 
+size_t CommandProcessor::enqueue_command_list(const uint32_t *words, size_t num_words)
+{
+	// Only consume complete commands.
+	size_t complete_words = 0;
+	bool has_meta_alias = false;
+	while (complete_words < num_words)
+	{
+		unsigned op = (words[complete_words] >> 24) & 63;
+		unsigned command_words = get_command_num_words(op);
+		if (complete_words + command_words > num_words)
+			break;
+		if (op < unsigned(Op::FillTriangle))
+			has_meta_alias = true;
+		complete_words += command_words;
+	}
+
+	const uint32_t *list_words = words;
+	size_t list_num_words = complete_words;
+
+	// Ops below 8 are no-ops in a display list, and would alias meta commands.
+	if (has_meta_alias)
+	{
+		filtered_commands.clear();
+		for (size_t offset = 0; offset < complete_words; )
+		{
+			unsigned op = (words[offset] >> 24) & 63;
+			unsigned command_words = get_command_num_words(op);
+			if (op >= unsigned(Op::FillTriangle))
+				filtered_commands.insert(filtered_commands.end(), words + offset, words + offset + command_words);
+			offset += command_words;
+		}
+
+		list_words = filtered_commands.data();
+		list_num_words = filtered_commands.size();
+	}
+
+	if (dump_writer || single_threaded_processing)
+	{
+		for (size_t offset = 0; offset < list_num_words; )
+		{
+			unsigned command_words = get_command_num_words((list_words[offset] >> 24) & 63);
+			enqueue_command(command_words, list_words + offset);
+			offset += command_words;
+		}
+	}
+	else if (decode_pool)
+		enqueue_command_list_decoded(list_words, list_num_words);
+	else
+		ring.enqueue_command_list(list_words, list_num_words);
+
+	return complete_words;
+}
+
+void CommandProcessor::set_rsp_dmem(const uint32_t *dmem)
+{
+	rsp_dmem = dmem;
+}
+
+const uint32_t *CommandProcessor::map_command_rdram()
+{
+	if (host_rdram)
+		return reinterpret_cast<const uint32_t *>(host_rdram);
+
+	auto *ptr = static_cast<const uint8_t *>(device.map_host_buffer(*rdram, MEMORY_ACCESS_READ_BIT));
+	return ptr ? reinterpret_cast<const uint32_t *>(ptr + rdram_offset) : nullptr;
+}
+
+bool CommandProcessor::process_dp_range(uint32_t start, uint32_t end, bool xbus)
+{
+	const uint32_t *memory;
+	uint32_t mask;
+
+	if (xbus)
+	{
+		memory = rsp_dmem;
+		mask = 0x3ff;
+	}
+	else
+	{
+		memory = map_command_rdram();
+		mask = ~0u;
+		start &= 0xffffff;
+		end &= 0xffffff;
+		if (end > rdram_size)
+		{
+			LOGE("DP range [0x%x, 0x%x) is outside RDRAM.\n", start, end);
+			return false;
+		}
+	}
+
+	start &= ~7u;
+	end &= ~7u;
+	if (!memory || end <= start)
+		return false;
+
+	uint32_t base = start >> 2;
+	size_t num_words = (end - start) >> 2;
+	size_t offset = 0;
+	bool sync_full = false;
+
+	const auto fetch = [&](size_t index) -> uint32_t {
+		return memory[(base + index) & mask];
+	};
+
+	// Complete a command which straddled the end of the previous range.
+	if (dp_carry_count)
+	{
+		unsigned command_words = get_command_num_words((dp_carry[0] >> 24) & 63);
+		while (dp_carry_count < command_words && offset < num_words)
+			dp_carry[dp_carry_count++] = fetch(offset++);
+
+		if (dp_carry_count < command_words)
+			return false;
+
+		unsigned op = (dp_carry[0] >> 24) & 63;
+		if (op >= unsigned(Op::FillTriangle))
+			enqueue_command(command_words, dp_carry);
+		sync_full = Op(op) == Op::SyncFull;
+		dp_carry_count = 0;
+	}
+
+	// Copy out the complete commands. The display list may be overwritten as soon as we return,
+	// e.g. DMEM by the next RSP task, or RDRAM by FIFO microcode which reuses its buffer.
+	if (!dump_writer && !single_threaded_processing && !decode_pool)
+	{
+		// Common case, copy straight into the command ring.
+		offset += ring.enqueue_display_list(memory, mask, base + uint32_t(offset), num_words - offset, sync_full);
+	}
+	else
+	{
+		// Dumping and decoding go per command, and enqueue_command() skips ops below 8.
+		while (offset < num_words)
+		{
+			unsigned op = (fetch(offset) >> 24) & 63;
+			unsigned command_words = get_command_num_words(op);
+			if (offset + command_words > num_words)
+				break;
+
+			if (Op(op) == Op::SyncFull)
+				sync_full = true;
+
+			uint32_t command[MaxCommandNumWords];
+			for (unsigned i = 0; i < command_words; i++)
+				command[i] = fetch(offset + i);
+			enqueue_command(command_words, command);
+			offset += command_words;
+		}
+	}
+
+	while (offset < num_words)
+		dp_carry[dp_carry_count++] = fetch(offset++);
+
+	return sync_full;
+}
+
+enum StateShadowBits
+{
+	STATE_SHADOW_OTHER_MODES_BIT = 1 << 0,
+	STATE_SHADOW_COMBINE_BIT = 1 << 1,
+	STATE_SHADOW_SCISSOR_BIT = 1 << 2,
+	STATE_SHADOW_TILE_BIT = 1 << 3,
+	STATE_SHADOW_TILE_SIZE_BIT = 1 << 11
+};
+
+static bool shadow_state_words(uint32_t *shadow, const uint32_t *words, uint32_t &valid_mask, uint32_t bit)
+{
+	if ((valid_mask & bit) != 0 && shadow[0] == words[0] && shadow[1] == words[1])
+		return true;
+
+	shadow[0] = words[0];
+	shadow[1] = words[1];
+	valid_mask |= bit;
+	return false;
+}
+
+bool CommandProcessor::is_redundant_state_command(Op op, const uint32_t *words)
+{
+	// Writing the same state twice is a no-op as long as nothing else modified the state in between.
+	// The only state which is modified implicitly is tile size, which is updated by TMEM loads.
+	uint32_t tile = (words[1] >> 24) & 7;
+
+	// Syncs are no-ops in this implementation either way, so they are not considered here.
+	switch (op)
+	{
+	case Op::SetOtherModes:
+		return shadow_state_words(state_shadow.other_modes, words, state_shadow.valid_mask, STATE_SHADOW_OTHER_MODES_BIT);
+
+	case Op::SetCombine:
+		return shadow_state_words(state_shadow.combine, words, state_shadow.valid_mask, STATE_SHADOW_COMBINE_BIT);
+
+	case Op::SetScissor:
+		return shadow_state_words(state_shadow.scissor, words, state_shadow.valid_mask, STATE_SHADOW_SCISSOR_BIT);
+
+	case Op::SetTile:
+		return shadow_state_words(state_shadow.tile[tile], words, state_shadow.valid_mask, STATE_SHADOW_TILE_BIT << tile);
+
+	case Op::SetTileSize:
+		return shadow_state_words(state_shadow.tile_size[tile], words, state_shadow.valid_mask, STATE_SHADOW_TILE_SIZE_BIT << tile);
+
+	case Op::LoadTile:
+	case Op::LoadBlock:
+	case Op::LoadTLut:
+		state_shadow.valid_mask &= ~(STATE_SHADOW_TILE_SIZE_BIT << tile);
+		return false;
+
+	default:
+		return false;
+	}
+}
+
 void CommandProcessor::enqueue_command_direct(unsigned, const uint32_t *words)
 {
 #define OP(x) &CommandProcessor::op_##x
@@ -941,7 +1419,7 @@ void CommandProcessor::enqueue_command_direct(unsigned, const uint32_t *words)
 
 	case Op::MetaIdle:
 	{
-		renderer.notify_idle_command_thread();
+		ring.record_idle_notification(renderer.notify_idle_command_thread());
 		break;
 	}
 
@@ -951,8 +1429,40 @@ void CommandProcessor::enqueue_command_direct(unsigned, const uint32_t *words)
 		break;
 	}
 
+	case Op::MetaSetFlushPolicy:
+	{
+		FlushPolicy policy;
+		policy.max_pending_render_passes = words[1];
+		policy.max_pending_primitives = words[2];
+		policy.submit_timeout_us = words[3];
+		policy.submit_when_gpu_idle = words[4] != 0;
+		policy.min_idle_flush_primitives = words[5];
+		policy.min_idle_flush_render_passes = words[6];
+		renderer.set_flush_policy(policy);
+		break;
+	}
+
+	case Op::MetaSnapshotFrameStatistics:
+	{
+		last_frame_stats = frame_stats;
+		frame_stats = {};
+		break;
+	}
+
+	case Op::MetaDrawTriangle:
+	{
+		TriangleSetup setup;
+		AttributeSetup attr;
+		memcpy(&setup, words + 1, sizeof(setup));
+		memcpy(&attr, words + 1 + sizeof(setup) / sizeof(uint32_t), sizeof(attr));
+		renderer.draw_shaded_primitive(setup, attr);
+		break;
+	}
+
 	default:
-		if (funcs[op])
+		if (filter_redundant_state && is_redundant_state_command(Op(op), words))
+			frame_stats.elided_state_commands++;
+		else if (funcs[op])
 			(this->*funcs[op])(words);
 		break;
 	}
@@ -967,6 +1477,30 @@ void CommandProcessor::set_quirks(const Quirks &quirks_)
 	enqueue_command_inner(2, words);
 }
 
+void CommandProcessor::set_flush_policy(const FlushPolicy &policy)
+{
+	const uint32_t words[7] = {
+		uint32_t(Op::MetaSetFlushPolicy) << 24u,
+		policy.max_pending_render_passes,
+		policy.max_pending_primitives,
+		policy.submit_timeout_us,
+		uint32_t(policy.submit_when_gpu_idle),
+		policy.min_idle_flush_primitives,
+		policy.min_idle_flush_render_passes,
+	};
+	enqueue_command_inner(7, words);
+}
+
+void CommandProcessor::set_idle_policy(const CommandRingIdlePolicy &policy)
+{
+	ring.set_idle_policy(policy);
+}
+
+CommandRingCounters CommandProcessor::get_idle_counters() const
+{
+	return ring.get_counters();
+}
+
 void CommandProcessor::set_vi_register(VIRegister reg, uint32_t value)
 {
 	vi.set_vi_register(reg, value);
@@ -1192,40 +1726,15 @@ bool CommandProcessor::FenceExecutor::is_sentinel(const CoherencyOperation &work
 	return !work.fence && !work.timeline_value;
 }
 
-static void masked_memcpy(uint8_t * __restrict dst,
-                          const uint8_t * __restrict data_src,
-                          const uint8_t * __restrict masked_src,
-                          size_t size)
+void CommandProcessor::FenceExecutor::copy_slice(const CoherencySlice &slice)
 {
-#if defined(__SSE2__)
-	for (size_t i = 0; i < size; i += 16)
-	{
-		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data_src + i));
-		__m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(masked_src + i));
-		_mm_maskmoveu_si128(data, mask, reinterpret_cast<char *>(dst + i));
-	}
-#else
-	auto * __restrict data32 = reinterpret_cast<const uint32_t *>(data_src);
-	auto * __restrict mask32 = reinterpret_cast<const uint32_t *>(masked_src);
-	auto * __restrict dst32 = reinterpret_cast<uint32_t *>(dst);
-	auto size32 = size >> 2;
-
-	for (size_t i = 0; i < size32; i++)
+	masked_memcpy(slice.dst, slice.data, slice.mask, slice.size);
+	for (unsigned i = 0; i < slice.counters; i++)
 	{
-		auto mask = mask32[i];
-		if (mask == ~0u)
-		{
-			dst32[i] = data32[i];
-		}
-		else if (mask)
-		{
-			// Fairly rare path.
-			for (unsigned j = 0; j < 4; j++)
-				if (masked_src[4 * i + j])
-					dst[4 * i + j] = data_src[4 * i + j];
-		}
+		unsigned val = slice.counter_base[i].fetch_sub(1, std::memory_order_release);
+		(void)val;
+		assert(val > 0);
 	}
-#endif
 }
 
 void CommandProcessor::FenceExecutor::perform_work(CoherencyOperation &work)
@@ -1238,22 +1747,46 @@ void CommandProcessor::FenceExecutor::perform_work(CoherencyOperation &work)
 
 	if (work.src)
 	{
+		constexpr size_t SliceSize = 16 * 1024;
+
+		slices.clear();
 		for (auto &copy : work.copies)
 		{
+			// Every counter covers one page, and the page size can change at runtime.
+			assert(copy.counters && copy.size % copy.counters == 0);
+			size_t page_size = copy.size / copy.counters;
+			unsigned pages_per_slice = unsigned(std::max(SliceSize / page_size, size_t(1)));
+
 			auto *mapped_data = static_cast<uint8_t *>(device->map_host_buffer(*work.src, MEMORY_ACCESS_READ_BIT, copy.src_offset, copy.size));
 			auto *mapped_mask = static_cast<uint8_t *>(device->map_host_buffer(*work.src, MEMORY_ACCESS_READ_BIT, copy.mask_offset, copy.size));
-			masked_memcpy(work.dst + copy.dst_offset, mapped_data, mapped_mask, copy.size);
-			for (unsigned i = 0; i < copy.counters; i++)
+
+			for (unsigned page = 0; page < copy.counters; page += pages_per_slice)
 			{
-				unsigned val = copy.counter_base[i].fetch_sub(1, std::memory_order_release);
-				(void)val;
-				assert(val > 0);
+				size_t offset = page * page_size;
+				CoherencySlice slice = {};
+				slice.dst = work.dst + copy.dst_offset + offset;
+				slice.data = mapped_data + offset;
+				slice.mask = mapped_mask + offset;
+				slice.size = std::min(copy.counters - page, pages_per_slice) * page_size;
+				slice.counter_base = copy.counter_base + page;
+				slice.counters = std::min(copy.counters - page, pages_per_slice);
+				slices.push_back(slice);
 			}
 		}
 
-#ifdef __SSE2__
-		_mm_mfence();
-#endif
+		if (slices.size() > 1 && num_readback_threads)
+		{
+			if (!readback_pool)
+				readback_pool.reset(new WorkerPool(num_readback_threads));
+			readback_pool->run(unsigned(slices.size()), [this](unsigned index) {
+				copy_slice(slices[index]);
+			});
+		}
+		else
+		{
+			for (auto &slice : slices)
+				copy_slice(slice);
+		}
 	}
 }
 
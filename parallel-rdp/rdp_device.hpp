@@ -31,6 +31,8 @@
 #include "rdp_common.hpp"
 #include "command_ring.hpp"
 #include "worker_thread.hpp"
+#include "worker_pool.hpp"
+#include "rdp_shared_context.hpp"
 #include "rdp_dump_write.hpp"
 
 namespace RDP
@@ -48,10 +50,37 @@ enum CommandProcessorFlagBits
 	COMMAND_PROCESSOR_FLAG_UPSCALING_4X_BIT = 1 << 3,
 	COMMAND_PROCESSOR_FLAG_UPSCALING_8X_BIT = 1 << 4,
 	COMMAND_PROCESSOR_FLAG_SUPER_SAMPLED_READ_BACK_BIT = 1 << 5,
-	COMMAND_PROCESSOR_FLAG_SUPER_SAMPLED_DITHER_BIT = 1 << 6
+	COMMAND_PROCESSOR_FLAG_SUPER_SAMPLED_DITHER_BIT = 1 << 6,
+	COMMAND_PROCESSOR_FLAG_PARALLEL_TRIANGLE_DECODE_BIT = 1 << 7,
+	// Render passes batch up to 256 primitives by default.
+	// Larger batches mean fewer binning and depth-blend dispatches in triangle heavy scenes,
+	// at the cost of more memory and coarser flushing.
+	COMMAND_PROCESSOR_FLAG_PRIMITIVE_BATCH_512_BIT = 1 << 8,
+	COMMAND_PROCESSOR_FLAG_PRIMITIVE_BATCH_1024_BIT = 1 << 9,
+	// Lets a render pass render to several non-overlapping framebuffers,
+	// so switching between small off-screen targets does not end the render pass.
+	// Has no effect with upscaling.
+	COMMAND_PROCESSOR_FLAG_MULTI_TARGET_RENDER_PASS_BIT = 1 << 10,
+	// Without VK_EXT_external_memory_host, write-protects RDRAM to find which pages the emulator writes to,
+	// so only those are uploaded to the GPU. Linux only. RDRAM must be aligned to host pages,
+	// and the emulator must not write to RDRAM from system calls, e.g. read(2), since those fail with EFAULT.
+	COMMAND_PROCESSOR_FLAG_DIRTY_PAGE_TRACKING_BIT = 1 << 11,
+	// Without VK_EXT_external_memory_host, RDRAM is kept coherent between host and GPU in pages.
+	// By default, the page size is selected from the RDRAM size and adapted to how RDRAM is accessed.
+	// These force a fixed page size. Smaller pages copy less data around, larger pages have less overhead.
+	COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_256_BIT = 1 << 12,
+	COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_1K_BIT = 1 << 13,
+	COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_4K_BIT = 1 << 14,
+	COMMAND_PROCESSOR_FLAG_INCOHERENT_PAGE_SIZE_16K_BIT = 1 << 15
 };
 using CommandProcessorFlags = uint32_t;
 
+// With COMMAND_PROCESSOR_FLAG_PARALLEL_TRIANGLE_DECODE_BIT, triangles are decoded before they enter the command ring.
+// They are passed along as Op::MetaDrawTriangle, followed by a TriangleSetup and an AttributeSetup.
+static_assert(sizeof(TriangleSetup) % sizeof(uint32_t) == 0, "TriangleSetup must be word aligned.");
+static_assert(sizeof(AttributeSetup) % sizeof(uint32_t) == 0, "AttributeSetup must be word aligned.");
+static constexpr unsigned DecodedTriangleNumWords = 1 + (sizeof(TriangleSetup) + sizeof(AttributeSetup)) / sizeof(uint32_t);
+
 struct CoherencyCopy
 {
 	size_t src_offset = 0;
@@ -108,6 +137,39 @@ struct Quirks
 	} u;
 };
 
+// Statistics for a frame context, i.e. everything between two calls to CommandProcessor::begin_frame_context().
+struct FrameStatistics
+{
+	// Redundant state commands which were dropped before reaching the renderer.
+	uint64_t elided_state_commands = 0;
+
+	// Render passes flushed, and primitives submitted in them.
+	uint64_t render_passes = 0;
+	uint64_t primitives = 0;
+
+	// Primitives which could not cover any tile, and were dropped before reaching the GPU.
+	uint64_t culled_primitives = 0;
+
+	// Rasterizer dispatches which used a specialized pipeline, and those which fell back to the generic variant
+	// while the specialized pipeline was being compiled. With a warm pipeline cache, the latter stays close to 0.
+	uint64_t specialized_rasterizer_dispatches = 0;
+	uint64_t generic_rasterizer_dispatches = 0;
+
+	// RDRAM pages read by the GPU which were not uploaded, since the CPU had not written to them.
+	// Only counted with COMMAND_PROCESSOR_FLAG_DIRTY_PAGE_TRACKING_BIT.
+	uint64_t skipped_clean_rdram_pages = 0;
+
+	// RDRAM pages copied from host memory to the GPU, the bytes copied, and the number of copies they were merged into.
+	// Only counted without VK_EXT_external_memory_host.
+	uint64_t uploaded_rdram_pages = 0;
+	uint64_t uploaded_rdram_bytes = 0;
+	uint64_t rdram_upload_copy_regions = 0;
+
+	// Why render passes were ended and why work was submitted to the GPU, indexed by FlushReason and SubmitReason.
+	uint64_t flushes[unsigned(FlushReason::Count)] = {};
+	uint64_t submits[unsigned(SubmitReason::Count)] = {};
+};
+
 class CommandProcessor
 {
 public:
@@ -118,6 +180,14 @@ public:
 	                 size_t hidden_rdram_size,
 	                 CommandProcessorFlags flags);
 
+	// Shares shaders, pipelines and lookup tables with other processors created from the same context.
+	CommandProcessor(SharedRDPContext &context,
+	                 void *rdram_ptr,
+	                 size_t rdram_offset,
+	                 size_t rdram_size,
+	                 size_t hidden_rdram_size,
+	                 CommandProcessorFlags flags);
+
 	~CommandProcessor();
 
 	void set_validation_interface(ValidationInterface *iface);
@@ -131,12 +201,41 @@ public:
 	void idle();
 	void begin_frame_context();
 
+	// Statistics for the previous frame context, updated in begin_frame_context().
+	const FrameStatistics &get_frame_statistics() const;
+
 	// Queues up state and drawing commands.
 	void enqueue_command(unsigned num_words, const uint32_t *words);
 	void enqueue_command_direct(unsigned num_words, const uint32_t *words);
 
+	// Queues up a span of a display list, e.g. DP_START to DP_END, and splits it into commands.
+	// Returns number of words consumed. If the span ends with an incomplete command,
+	// those words are not consumed and must be submitted again along with the rest of the command.
+	// Ops 0 to 7 are skipped like the hardware does.
+	size_t enqueue_command_list(const uint32_t *words, size_t num_words);
+
+	// Emulates DP_START / DP_END. Reads the display list in [start, end) from RDRAM,
+	// or from RSP DMEM if xbus is set. The commands are copied before this returns,
+	// so the display list can be overwritten right away, e.g. after setting DP_CURRENT = DP_END.
+	// Incomplete commands at the end of the range are carried over to the next call.
+	// Returns true if a SyncFull was queued. It has not necessarily been processed yet,
+	// so the caller must sync, e.g. wait_for_timeline(signal_timeline()), before raising the DP interrupt.
+	bool process_dp_range(uint32_t start, uint32_t end, bool xbus);
+
+	// RSP DMEM (4 KiB) to read from when process_dp_range() is called with xbus.
+	void set_rsp_dmem(const uint32_t *dmem);
+
 	void set_quirks(const Quirks &quirks);
 
+	// Controls how eagerly render passes are submitted to the GPU.
+	// Submitting more often reduces latency, submitting less often reduces CPU and driver overhead.
+	void set_flush_policy(const FlushPolicy &policy);
+
+	// Controls how the command thread behaves when it runs out of work.
+	// Lower kick thresholds reduce latency for hard-synced emulation at the cost of CPU time.
+	void set_idle_policy(const CommandRingIdlePolicy &policy);
+	CommandRingCounters get_idle_counters() const;
+
 	// Interact with memory.
 	void *begin_read_rdram();
 	void end_write_rdram();
@@ -197,6 +296,14 @@ public:
 	// scanout();
 
 private:
+	CommandProcessor(Vulkan::Device &device,
+	                 SharedRDPContext *context,
+	                 void *rdram_ptr,
+	                 size_t rdram_offset,
+	                 size_t rdram_size,
+	                 size_t hidden_rdram_size,
+	                 CommandProcessorFlags flags);
+
 	Vulkan::Device &device;
 	Vulkan::BufferHandle rdram;
 	Vulkan::BufferHandle hidden_rdram;
@@ -204,9 +311,8 @@ private:
 	size_t rdram_offset;
 	size_t rdram_size;
 	CommandProcessorFlags flags;
-#ifndef PARALLEL_RDP_SHADER_DIR
-	std::unique_ptr<ShaderBank> shader_bank;
-#endif
+	std::unique_ptr<SharedRDPContext> owned_context;
+	SharedRDPContext *context;
 
 	// Tear-down order is important here.
 	Renderer renderer;
@@ -218,6 +324,9 @@ private:
 	void clear_buffer(Vulkan::Buffer &buffer, uint32_t value);
 	void init_renderer();
 	void enqueue_command_inner(unsigned num_words, const uint32_t *words);
+	void enqueue_command_decoded(unsigned num_words, const uint32_t *words);
+	void enqueue_command_list_decoded(const uint32_t *words, size_t num_words);
+	const uint32_t *map_command_rdram();
 
 	Vulkan::ImageHandle scanout(const ScanoutOptions &opts, VkImageLayout target_layout);
 
@@ -233,6 +342,22 @@ private:
 	OP(set_combine); OP(set_texture_image); OP(set_mask_image); OP(set_color_image);
 #undef OP
 
+	// Raw words of the last state commands, used to drop commands which would not change any state.
+	struct
+	{
+		uint32_t other_modes[2];
+		uint32_t combine[2];
+		uint32_t scissor[2];
+		uint32_t tile[8][2];
+		uint32_t tile_size[8][2];
+		uint32_t valid_mask;
+	} state_shadow = {};
+	bool filter_redundant_state = true;
+	bool is_redundant_state_command(Op op, const uint32_t *words);
+
+	FrameStatistics frame_stats;
+	FrameStatistics last_frame_stats;
+
 	ScissorState scissor_state = {};
 	StaticRasterizationState static_state = {};
 	DepthBlendState depth_blend = {};
@@ -250,16 +375,34 @@ private:
 
 	struct FenceExecutor
 	{
-		explicit inline FenceExecutor(Vulkan::Device *device_, uint64_t *ptr)
-			: device(device_), value(ptr)
+		explicit inline FenceExecutor(Vulkan::Device *device_, uint64_t *ptr, unsigned num_readback_threads_)
+			: device(device_), value(ptr), num_readback_threads(num_readback_threads_)
 		{
 		}
 
 		Vulkan::Device *device;
 		uint64_t *value;
+
+		// Readbacks are split into slices of a few pages, which are copied in parallel.
+		// The pending write counters of a slice are released as soon as it has been copied.
+		struct CoherencySlice
+		{
+			uint8_t *dst;
+			const uint8_t *data;
+			const uint8_t *mask;
+			size_t size;
+			std::atomic_uint32_t *counter_base;
+			unsigned counters;
+		};
+		std::vector<CoherencySlice> slices;
+		unsigned num_readback_threads;
+		// Created on first use, since host coherent RDRAM is never read back.
+		std::unique_ptr<WorkerPool> readback_pool;
+
 		bool is_sentinel(const CoherencyOperation &work) const;
 		void perform_work(CoherencyOperation &work);
 		void notify_work_locked(const CoherencyOperation &work);
+		void copy_slice(const CoherencySlice &slice);
 	};
 	WorkerThread<CoherencyOperation, FenceExecutor> timeline_worker;
 
@@ -278,6 +421,28 @@ private:
 
 	Quirks quirks;
 
+	// Producer side decoding of triangles.
+	// Tracks just enough state to decode triangles exactly like the command thread would.
+	struct DecodeJob
+	{
+		const uint32_t *words;
+		size_t offset;
+		bool copy_cycle;
+	};
+	std::unique_ptr<WorkerPool> decode_pool;
+	std::vector<DecodeJob> decode_jobs;
+	std::vector<uint32_t> decoded_commands;
+	bool decode_copy_cycle = false;
+	bool decode_native_texture_lod = false;
+
+	// Display list fetch state for process_dp_range().
+	const uint32_t *rsp_dmem = nullptr;
+	uint32_t dp_carry[MaxCommandNumWords];
+	unsigned dp_carry_count = 0;
+
+	// Display lists with ops aliasing meta commands are compacted here by enqueue_command_list().
+	std::vector<uint32_t> filtered_commands;
+
 	std::unique_ptr<RDPDumpWriter> dump_writer;
 	bool dump_in_command_list = false;
 };
@@ -0,0 +1,204 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_dirty_tracker.hpp"
+#include "logging.hpp"
+#include "bitops.hpp"
+#include <mutex>
+#include <algorithm>
+
+#ifdef __linux__
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace RDP
+{
+#ifdef __linux__
+// The signal handler cannot take locks, so trackers are registered in a fixed lock-free table.
+static constexpr unsigned MaxTrackers = 16;
+static std::atomic<DirtyPageTracker *> registered_trackers[MaxTrackers];
+static std::mutex install_lock;
+static bool handler_installed;
+static struct sigaction chained_action;
+
+static void write_fault_handler(int sig, siginfo_t *info, void *context)
+{
+	if (info->si_code == SEGV_ACCERR)
+	{
+		for (auto &tracker : registered_trackers)
+		{
+			auto *t = tracker.load(std::memory_order_acquire);
+			if (t && t->handle_write_fault(info->si_addr))
+				return;
+		}
+	}
+
+	// Not ours, forward to whatever handler was installed before us.
+	if (chained_action.sa_flags & SA_SIGINFO)
+		chained_action.sa_sigaction(sig, info, context);
+	else if (chained_action.sa_handler == SIG_DFL || chained_action.sa_handler == SIG_IGN)
+	{
+		// Returning re-executes the faulting instruction, which now takes the default action.
+		signal(sig, SIG_DFL);
+	}
+	else
+		chained_action.sa_handler(sig);
+}
+
+static bool install_write_fault_handler()
+{
+	std::lock_guard<std::mutex> holder{install_lock};
+	if (handler_installed)
+		return true;
+
+	struct sigaction action = {};
+	action.sa_sigaction = write_fault_handler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGSEGV, &action, &chained_action) != 0)
+	{
+		LOGE("Failed to install SIGSEGV handler for dirty page tracking.\n");
+		return false;
+	}
+
+	handler_installed = true;
+	return true;
+}
+
+bool DirtyPageTracker::init(uint8_t *base_, size_t size_)
+{
+	page_size = size_t(sysconf(_SC_PAGESIZE));
+	if ((reinterpret_cast<uintptr_t>(base_) & (page_size - 1)) != 0 || (size_ & (page_size - 1)) != 0 || size_ == 0)
+	{
+		LOGW("RDRAM is not aligned to host pages, cannot track dirty pages.\n");
+		return false;
+	}
+
+	if (!install_write_fault_handler())
+		return false;
+
+	num_pages = unsigned(size_ / page_size);
+	unsigned num_words = (num_pages + 31) / 32;
+	dirty_pages.reset(new std::atomic_uint32_t[num_words]);
+	for (unsigned i = 0; i < num_words; i++)
+	{
+		unsigned pages_in_word = std::min(num_pages - 32 * i, 32u);
+		dirty_pages[i].store(pages_in_word == 32 ? ~0u : ((1u << pages_in_word) - 1u), std::memory_order_relaxed);
+	}
+
+	base = base_;
+	size = size_;
+
+	for (auto &tracker : registered_trackers)
+	{
+		DirtyPageTracker *expected = nullptr;
+		if (tracker.compare_exchange_strong(expected, this, std::memory_order_release))
+			return true;
+	}
+
+	LOGE("Too many dirty page trackers.\n");
+	base = nullptr;
+	size = 0;
+	return false;
+}
+
+DirtyPageTracker::~DirtyPageTracker()
+{
+	if (!base)
+		return;
+
+	// Leave the memory writable for whoever owns it after we're gone.
+	mprotect(base, size, PROT_READ | PROT_WRITE);
+
+	for (auto &tracker : registered_trackers)
+	{
+		DirtyPageTracker *expected = this;
+		if (tracker.compare_exchange_strong(expected, nullptr, std::memory_order_release))
+			break;
+	}
+}
+
+bool DirtyPageTracker::handle_write_fault(const void *addr)
+{
+	auto *ptr = static_cast<const uint8_t *>(addr);
+	if (ptr < base || ptr >= base + size)
+		return false;
+
+	auto page = unsigned((ptr - base) / page_size);
+
+	// Make the page writable before marking it dirty.
+	// The harvest clears dirty bits before it write-protects, so a write can never end up on a writable page
+	// whose dirty bit has been consumed without the harvest knowing about it.
+	mprotect(base + page * page_size, page_size, PROT_READ | PROT_WRITE);
+	dirty_pages[page / 32].fetch_or(1u << (page & 31), std::memory_order_release);
+	return true;
+}
+
+void DirtyPageTracker::harvest_dirty_pages(uint32_t *dirty_mask, size_t mask_page_size)
+{
+	unsigned num_words = (num_pages + 31) / 32;
+
+	for (unsigned i = 0; i < num_words; i++)
+	{
+		uint32_t bits = dirty_pages[i].exchange(0, std::memory_order_acquire);
+		Util::for_each_bit_range(bits, [&](unsigned index, unsigned count) {
+			index += 32 * i;
+
+			// Writes which land before the page is protected again are not lost,
+			// since the caller has yet to copy the pages we return.
+			mprotect(base + index * page_size, count * page_size, PROT_READ);
+
+			auto first_mask_page = unsigned(index * page_size / mask_page_size);
+			auto last_mask_page = unsigned(((index + count) * page_size - 1) / mask_page_size);
+			for (unsigned mask_page = first_mask_page; mask_page <= last_mask_page; mask_page++)
+				dirty_mask[mask_page / 32] |= 1u << (mask_page & 31);
+		});
+	}
+}
+#else
+bool DirtyPageTracker::init(uint8_t *, size_t)
+{
+	LOGW("Dirty page tracking is not supported on this platform.\n");
+	return false;
+}
+
+DirtyPageTracker::~DirtyPageTracker()
+{
+}
+
+bool DirtyPageTracker::handle_write_fault(const void *)
+{
+	return false;
+}
+
+void DirtyPageTracker::harvest_dirty_pages(uint32_t *, size_t)
+{
+}
+#endif
+
+size_t DirtyPageTracker::get_page_size() const
+{
+	return page_size;
+}
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+
+namespace RDP
+{
+// Tracks which pages of host memory the CPU has written to.
+// Pages are write-protected, and the first write to a page after it has been harvested
+// is caught in a SIGSEGV handler which marks the page dirty and makes it writable again.
+// Only implemented on Linux. Elsewhere, init() fails and all memory has to be treated as dirty.
+class DirtyPageTracker
+{
+public:
+	DirtyPageTracker() = default;
+	~DirtyPageTracker();
+
+	DirtyPageTracker(const DirtyPageTracker &) = delete;
+	void operator=(const DirtyPageTracker &) = delete;
+
+	// base and size must be aligned to the host page size.
+	// All pages start out dirty.
+	bool init(uint8_t *base, size_t size);
+
+	size_t get_page_size() const;
+
+	// Sets a bit in dirty_mask for every mask_page_size block which overlaps a page written since the last harvest,
+	// and write-protects those pages again.
+	void harvest_dirty_pages(uint32_t *dirty_mask, size_t mask_page_size);
+
+	// Called from the signal handler.
+	bool handle_write_fault(const void *addr);
+
+private:
+	uint8_t *base = nullptr;
+	size_t size = 0;
+	size_t page_size = 0;
+	unsigned num_pages = 0;
+	std::unique_ptr<std::atomic_uint32_t[]> dirty_pages;
+};
+}
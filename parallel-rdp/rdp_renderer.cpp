@@ -23,9 +23,9 @@
 #define NOMINMAX
 #include "rdp_renderer.hpp"
 #include "rdp_device.hpp"
+#include "rdp_shared_context.hpp"
 #include "logging.hpp"
 #include "bitops.hpp"
-#include "luts.hpp"
 #include "timer.hpp"
 #include <limits>
 #include <stdlib.h>
@@ -53,6 +53,11 @@ void Renderer::set_shader_bank(const ShaderBank *bank)
 	shader_bank = bank;
 }
 
+void Renderer::set_shared_context(SharedRDPContext *context)
+{
+	shared_context = context;
+}
+
 bool Renderer::init_renderer(const RendererOptions &options)
 {
 	if (options.upscaling_factor == 0)
@@ -66,12 +71,61 @@ bool Renderer::init_renderer(const RendererOptions &options)
 	caps.max_tiles_y = options.upscaling_factor * ImplementationConstants::MaxTilesY;
 	caps.max_num_tile_instances = options.upscaling_factor * options.upscaling_factor * Limits::MaxTileInstances;
 
-#ifdef PARALLEL_RDP_SHADER_DIR
-	pipeline_worker.reset(new WorkerThread<Vulkan::DeferredPipelineCompile, PipelineExecutor>(
-			Granite::Global::create_thread_context(), { device }));
-#else
-	pipeline_worker.reset(new WorkerThread<Vulkan::DeferredPipelineCompile, PipelineExecutor>({ device }));
-#endif
+	if (options.max_primitives != 256 && options.max_primitives != 512 && options.max_primitives != 1024)
+	{
+		LOGE("Invalid number of primitives per render pass: %u.\n", options.max_primitives);
+		return false;
+	}
+	caps.max_primitives = options.max_primitives;
+
+	if (options.max_render_pass_targets == 0 || options.max_render_pass_targets > Limits::MaxRenderPassTargets)
+	{
+		LOGE("Invalid number of render pass targets: %u.\n", options.max_render_pass_targets);
+		return false;
+	}
+
+	// Upscaled render passes resolve a single framebuffer.
+	if (options.upscaling_factor == 1)
+		caps.max_render_pass_targets = options.max_render_pass_targets;
+	else
+		caps.max_render_pass_targets = 1;
+
+	caps.record_variant_usage = shared_context->is_recording_variant_usage();
+
+	// Tile coverage is estimated in the upscaled domain, which does not prove the 1x render pass is empty as well.
+	caps.cull_empty_primitives = options.cull_empty_primitives && options.upscaling_factor == 1;
+
+	if (options.incoherent_page_size &&
+	    (options.incoherent_page_size < ImplementationConstants::MinIncoherentPageSize ||
+	     options.incoherent_page_size > ImplementationConstants::MaxIncoherentPageSize ||
+	     (options.incoherent_page_size & (options.incoherent_page_size - 1)) != 0))
+	{
+		LOGE("Invalid incoherent page size: %u.\n", options.incoherent_page_size);
+		return false;
+	}
+
+	if (!is_host_coherent)
+	{
+		if (options.incoherent_page_size)
+			set_incoherent_page_size(options.incoherent_page_size);
+		incoherent.adaptive_page_size = options.incoherent_page_size == 0;
+	}
+
+	if (!is_host_coherent && options.track_dirty_pages)
+		init_dirty_page_tracking();
+
+	stream.triangle_setup.set_capacity(caps.max_primitives);
+	stream.scissor_setup.set_capacity(caps.max_primitives);
+	stream.attribute_setup.set_capacity(caps.max_primitives);
+	stream.derived_setup.set_capacity(caps.max_primitives);
+	stream.derived_setup_inputs.set_capacity(caps.max_primitives);
+
+	if (options.derived_setup_threads)
+		derived_setup_pool.reset(new WorkerPool(options.derived_setup_threads));
+	else
+		derived_setup_pool.reset();
+	stream.state_indices.set_capacity(caps.max_primitives);
+	stream.span_info_offsets.set_capacity(caps.max_primitives);
 
 #ifdef PARALLEL_RDP_SHADER_DIR
 	if (!GRANITE_FILESYSTEM()->get_backend("rdp"))
@@ -79,8 +133,8 @@ bool Renderer::init_renderer(const RendererOptions &options)
 	device->get_shader_manager().add_include_directory("builtin://shaders/inc");
 #endif
 
-	for (auto &buffer : buffer_instances)
-		buffer.init(*device);
+	render_buffers.init(*device, caps.max_primitives);
+	reserve_render_buffers();
 
 	if (const char *env = getenv("RDP_DEBUG"))
 		debug_channel = strtoul(env, nullptr, 0) != 0;
@@ -110,7 +164,6 @@ bool Renderer::init_renderer(const RendererOptions &options)
 		device->set_name(*span_setups, "span-setups");
 	}
 
-	init_blender_lut();
 	init_buffers(options);
 	if (options.upscaling_factor > 1 && !init_internal_upscaling_factor(options))
 		return false;
@@ -280,7 +333,7 @@ void Renderer::init_buffers(const RendererOptions &options)
 	static_assert(Limits::MaxPrimitives <= (32 * 32), "MaxPrimitives must be less-or-equal than 1024.");
 
 	info.size = sizeof(uint32_t) *
-	            (Limits::MaxPrimitives / 32) *
+	            (caps.max_primitives / 32) *
 	            (caps.max_width / ImplementationConstants::TileWidth) *
 	            (caps.max_height / ImplementationConstants::TileHeight);
 
@@ -297,7 +350,7 @@ void Renderer::init_buffers(const RendererOptions &options)
 	if (!caps.ubershader)
 	{
 		info.size = sizeof(uint32_t) *
-		            (Limits::MaxPrimitives / 32) *
+		            (caps.max_primitives / 32) *
 		            (caps.max_width / ImplementationConstants::TileWidth) *
 		            (caps.max_height / ImplementationConstants::TileHeight);
 
@@ -328,23 +381,6 @@ void Renderer::init_buffers(const RendererOptions &options)
 	}
 }
 
-void Renderer::init_blender_lut()
-{
-	Vulkan::BufferCreateInfo info = {};
-	info.size = sizeof(blender_lut);
-	info.domain = Vulkan::BufferDomain::Device;
-	info.usage = VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT;
-
-	blender_divider_lut_buffer = device->create_buffer(info, blender_lut);
-	device->set_name(*blender_divider_lut_buffer, "blender-divider-lut-buffer");
-
-	Vulkan::BufferViewCreateInfo view = {};
-	view.buffer = blender_divider_lut_buffer.get();
-	view.format = VK_FORMAT_R8_UINT;
-	view.range = info.size;
-	blender_divider_buffer = device->create_buffer_view(view);
-}
-
 void Renderer::message(const std::string &tag, uint32_t code, uint32_t x, uint32_t y, uint32_t, uint32_t num_words,
                        const Vulkan::DebugChannelInterface::Word *words)
 {
@@ -444,60 +480,31 @@ void Renderer::message(const std::string &tag, uint32_t code, uint32_t x, uint32
 }
 
 void Renderer::RenderBuffers::init(Vulkan::Device &device, Vulkan::BufferDomain domain,
-                                   RenderBuffers *borrow)
-{
-	triangle_setup = create_buffer(device, domain,
-	                               sizeof(TriangleSetup) * Limits::MaxPrimitives,
-	                               borrow ? &borrow->triangle_setup : nullptr);
-	device.set_name(*triangle_setup.buffer, "triangle-setup");
-
-	attribute_setup = create_buffer(device, domain,
-	                                sizeof(AttributeSetup) * Limits::MaxPrimitives,
-	                                borrow ? &borrow->attribute_setup: nullptr);
-	device.set_name(*attribute_setup.buffer, "attribute-setup");
-
-	derived_setup = create_buffer(device, domain,
-	                              sizeof(DerivedSetup) * Limits::MaxPrimitives,
-	                              borrow ? &borrow->derived_setup : nullptr);
-	device.set_name(*derived_setup.buffer, "derived-setup");
-
-	scissor_setup = create_buffer(device, domain,
-	                              sizeof(ScissorState) * Limits::MaxPrimitives,
-	                              borrow ? &borrow->scissor_setup : nullptr);
-	device.set_name(*scissor_setup.buffer, "scissor-state");
-
-	static_raster_state = create_buffer(device, domain,
-	                                    sizeof(StaticRasterizationState) * Limits::MaxStaticRasterizationStates,
-	                                    borrow ? &borrow->static_raster_state : nullptr);
-	device.set_name(*static_raster_state.buffer, "static-raster-state");
-
-	depth_blend_state = create_buffer(device, domain,
-	                                  sizeof(DepthBlendState) * Limits::MaxDepthBlendStates,
-	                                  borrow ? &borrow->depth_blend_state : nullptr);
-	device.set_name(*depth_blend_state.buffer, "depth-blend-state");
-
-	tile_info_state = create_buffer(device, domain,
-	                                sizeof(TileInfo) * Limits::MaxTileInfoStates,
-	                                borrow ? &borrow->tile_info_state : nullptr);
-	device.set_name(*tile_info_state.buffer, "tile-info-state");
-
-	state_indices = create_buffer(device, domain,
-	                              sizeof(InstanceIndices) * Limits::MaxPrimitives,
-	                              borrow ? &borrow->state_indices : nullptr);
-	device.set_name(*state_indices.buffer, "state-indices");
-
-	span_info_offsets = create_buffer(device, domain,
-	                                  sizeof(SpanInfoOffsets) * Limits::MaxPrimitives,
-	                                  borrow ? &borrow->span_info_offsets : nullptr);
-	device.set_name(*span_info_offsets.buffer, "span-info-offsets");
-
-	span_info_jobs = create_buffer(device, domain,
-	                               sizeof(SpanInterpolationJob) * Limits::MaxSpanSetups,
-	                               borrow ? &borrow->span_info_jobs : nullptr);
-	device.set_name(*span_info_jobs.buffer, "span-info-jobs");
+                                   const VkDeviceSize *sizes, RenderBuffers *borrow)
+{
+	static const char *names[] = {
+		"triangle-setup",
+		"attribute-setup",
+		"derived-setup",
+		"scissor-state",
+		"static-raster-state",
+		"depth-blend-state",
+		"tile-info-state",
+		"state-indices",
+		"span-info-offsets",
+		"span-info-jobs",
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == unsigned(RenderBufferType::Count), "Missing render buffer names.");
+
+	for (unsigned i = 0; i < unsigned(RenderBufferType::Count); i++)
+	{
+		buffers[i] = create_buffer(device, domain, sizes[i], borrow ? &borrow->buffers[i] : nullptr);
+		device.set_name(*buffers[i].buffer, names[i]);
+	}
 
 	if (!borrow)
 	{
+		auto &span_info_jobs = buffers[unsigned(RenderBufferType::SpanInfoJobs)];
 		Vulkan::BufferViewCreateInfo info = {};
 		info.buffer = span_info_jobs.buffer.get();
 		info.format = VK_FORMAT_R16G16B16A16_UINT;
@@ -536,10 +543,61 @@ Renderer::MappedBuffer Renderer::RenderBuffers::create_buffer(
 	return buffer;
 }
 
-void Renderer::RenderBuffersUpdater::init(Vulkan::Device &device)
+void Renderer::RenderBuffersUpdater::init(Vulkan::Device &device, unsigned max_primitives)
 {
-	gpu.init(device, Vulkan::BufferDomain::LinkedDeviceHostPreferDevice, nullptr);
-	cpu.init(device, Vulkan::BufferDomain::Host, &gpu);
+	auto &limits = device.get_gpu_properties().limits;
+	// Keep sub-allocations aligned to whole span jobs and cache lines as well.
+	alignment = std::max<VkDeviceSize>(limits.minStorageBufferOffsetAlignment, 64);
+
+	const VkDeviceSize pass_sizes[] = {
+		sizeof(TriangleSetup) * max_primitives,
+		sizeof(AttributeSetup) * max_primitives,
+		sizeof(DerivedSetup) * max_primitives,
+		sizeof(ScissorState) * max_primitives,
+		sizeof(StaticRasterizationState) * Limits::MaxStaticRasterizationStates,
+		sizeof(DepthBlendState) * Limits::MaxDepthBlendStates,
+		sizeof(TileInfo) * Limits::MaxTileInfoStates,
+		sizeof(InstanceIndices) * max_primitives,
+		sizeof(SpanInfoOffsets) * max_primitives,
+		sizeof(SpanInterpolationJob) * Limits::MaxSpanSetups,
+	};
+	static_assert(sizeof(pass_sizes) / sizeof(pass_sizes[0]) == unsigned(RenderBufferType::Count), "Missing render buffer sizes.");
+
+	VkDeviceSize sizes[unsigned(RenderBufferType::Count)];
+	for (unsigned i = 0; i < unsigned(RenderBufferType::Count); i++)
+	{
+		auto &ring = rings[i];
+		ring = {};
+		ring.pass_size = (pass_sizes[i] + alignment - 1) & ~(alignment - 1);
+		ring.size = ring.pass_size * Limits::RenderBufferRingPasses;
+		sizes[i] = ring.size;
+	}
+
+	// The span jobs are read through a texel buffer, which is the tightest limit on ring size.
+	auto &jobs = rings[unsigned(RenderBufferType::SpanInfoJobs)];
+	unsigned max_job_passes = limits.maxTexelBufferElements / Limits::MaxSpanSetups;
+	if (max_job_passes < Limits::RenderBufferRingPasses)
+	{
+		jobs.size = jobs.pass_size * std::max(max_job_passes, 2u);
+		sizes[unsigned(RenderBufferType::SpanInfoJobs)] = jobs.size;
+	}
+
+	submissions.clear();
+	gpu.init(device, Vulkan::BufferDomain::LinkedDeviceHostPreferDevice, sizes, nullptr);
+	cpu.init(device, Vulkan::BufferDomain::Host, sizes, &gpu);
+}
+
+VkDeviceSize Renderer::RenderBuffersUpdater::get_offset(RenderBufferType type) const
+{
+	auto &ring = rings[unsigned(type)];
+	return ring.begin % ring.size;
+}
+
+void Renderer::RenderBuffersUpdater::bind_storage_buffer(Vulkan::CommandBuffer &cmd, unsigned set, unsigned binding,
+                                                         RenderBufferType type) const
+{
+	cmd.set_storage_buffer(set, binding, *gpu.buffers[unsigned(type)].buffer,
+	                       get_offset(type), rings[unsigned(type)].pass_size);
 }
 
 bool Renderer::init_internal_upscaling_factor(const RendererOptions &options)
@@ -616,15 +674,17 @@ void Renderer::set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t off
 		// If we're not host coherent (missing VK_EXT_external_memory_host),
 		// we need to create a staging RDRAM buffer which is used for the real RDRAM uploads.
 		// RDRAM may be uploaded in a masked way (if GPU has pending writes), or direct copy (if no pending writes are outstanding).
+		// Uploads are allocated from a ring, so a flush does not overwrite pages which an earlier submission still copies from.
+		// A flush uploads every page at most once, so a ring the size of RDRAM always fits the next upload.
+		incoherent.staging_ring_size = size + ImplementationConstants::MaxIncoherentPageSize - 1;
+		incoherent.staging_ring_size &= ~uint64_t(ImplementationConstants::MaxIncoherentPageSize - 1);
 		Vulkan::BufferCreateInfo info = {};
-		info.size = size;
+		info.size = incoherent.staging_ring_size;
 		info.domain = Vulkan::BufferDomain::Host;
 		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 		incoherent.staging_rdram = device->create_buffer(info);
 		device->set_name(*incoherent.staging_rdram, "staging-rdram");
 
-		const auto div_round_up = [](size_t a, size_t b) -> size_t { return (a + b - 1) / b; };
-
 		if (!rdram->get_allocation().is_host_allocation())
 		{
 			// If we cannot map RDRAM, we need a staging readback buffer.
@@ -634,22 +694,21 @@ void Renderer::set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t off
 			readback_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 			incoherent.staging_readback = device->create_buffer(readback_info);
 			device->set_name(*incoherent.staging_readback, "staging-readback");
-			incoherent.staging_readback_pages = div_round_up(readback_info.size, ImplementationConstants::IncoherentPageSize);
 		}
 
 		incoherent.page_to_direct_copy.clear();
 		incoherent.page_to_masked_copy.clear();
 		incoherent.page_to_pending_readback.clear();
+		incoherent.page_size = 0;
 
-		auto packed_pages = div_round_up(size, ImplementationConstants::IncoherentPageSize * 32);
-		incoherent.num_pages = div_round_up(size, ImplementationConstants::IncoherentPageSize);
-
-		incoherent.page_to_direct_copy.resize(packed_pages);
-		incoherent.page_to_masked_copy.resize(packed_pages);
-		incoherent.page_to_pending_readback.resize(packed_pages);
-		incoherent.pending_writes_for_page.reset(new std::atomic_uint32_t[incoherent.num_pages]);
-		for (unsigned i = 0; i < incoherent.num_pages; i++)
-			incoherent.pending_writes_for_page[i].store(0);
+		// Aim for a few thousand pages. It is adapted later unless overridden with RendererOptions.
+		unsigned page_size = ImplementationConstants::MinIncoherentPageSize;
+		while (page_size < ImplementationConstants::MaxIncoherentPageSize &&
+		       size / page_size > ImplementationConstants::TargetIncoherentPages)
+		{
+			page_size *= 2;
+		}
+		set_incoherent_page_size(page_size);
 	}
 	else
 	{
@@ -657,6 +716,129 @@ void Renderer::set_rdram(Vulkan::Buffer *buffer, uint8_t *host_rdram, size_t off
 	}
 }
 
+static void convert_page_mask(std::vector<uint32_t> &mask, unsigned old_page_size,
+                              unsigned new_page_size, unsigned new_num_pages)
+{
+	// Conversion is conservative, any page which overlaps a set page is set.
+	std::vector<uint32_t> converted((new_num_pages + 31) / 32);
+
+	for (size_t i = 0; i < mask.size(); i++)
+	{
+		Util::for_each_bit_range(mask[i], [&](unsigned index, unsigned count) {
+			index += 32 * unsigned(i);
+			size_t begin = size_t(index) * old_page_size;
+			size_t end = size_t(index + count) * old_page_size;
+			auto first_page = unsigned(begin / new_page_size);
+			auto last_page = std::min(unsigned((end - 1) / new_page_size), new_num_pages - 1);
+			for (unsigned page = first_page; page <= last_page; page++)
+				converted[page / 32] |= 1u << (page & 31);
+		});
+	}
+
+	mask = std::move(converted);
+}
+
+void Renderer::set_incoherent_page_size(unsigned page_size)
+{
+	// Must not be called while GPU writes to RDRAM are pending, since their pages cannot be converted.
+	unsigned old_page_size = incoherent.page_size;
+	auto num_pages = unsigned((rdram_size + page_size - 1) / page_size);
+
+	convert_page_mask(incoherent.page_to_direct_copy, old_page_size, page_size, num_pages);
+	convert_page_mask(incoherent.page_to_masked_copy, old_page_size, page_size, num_pages);
+	convert_page_mask(incoherent.page_to_pending_readback, old_page_size, page_size, num_pages);
+	if (incoherent.dirty_tracker)
+		convert_page_mask(incoherent.page_to_cpu_dirty, old_page_size, page_size, num_pages);
+
+	incoherent.pending_writes_for_page.reset(new std::atomic_uint32_t[num_pages]);
+	for (unsigned i = 0; i < num_pages; i++)
+		incoherent.pending_writes_for_page[i].store(0);
+
+	// Staging ring positions are in bytes, but allocations must start on a page boundary.
+	incoherent.staging_head = (incoherent.staging_head + page_size - 1) & ~uint64_t(page_size - 1);
+
+	if (incoherent.staging_readback)
+	{
+		incoherent.staging_readback_pages = unsigned(incoherent.staging_readback->get_create_info().size / page_size);
+		if (old_page_size)
+		{
+			incoherent.staging_readback_index = unsigned((uint64_t(incoherent.staging_readback_index) * old_page_size + page_size - 1) / page_size);
+			incoherent.staging_readback_index &= incoherent.staging_readback_pages - 1;
+		}
+	}
+
+	incoherent.page_size = page_size;
+	incoherent.num_pages = num_pages;
+	incoherent.requested_read_bytes = 0;
+	incoherent.marked_read_pages = 0;
+	incoherent.flushes_since_adapt = 0;
+}
+
+bool Renderer::incoherent_pages_are_idle() const
+{
+	for (auto &mask : incoherent.page_to_pending_readback)
+		if (mask)
+			return false;
+
+	for (unsigned i = 0; i < incoherent.num_pages; i++)
+		if (incoherent.pending_writes_for_page[i].load(std::memory_order_acquire) != 0)
+			return false;
+
+	return true;
+}
+
+void Renderer::adapt_incoherent_page_size()
+{
+	if (!incoherent.adaptive_page_size ||
+	    ++incoherent.flushes_since_adapt < ImplementationConstants::IncoherentPageSizeAdaptInterval)
+	{
+		return;
+	}
+
+	// Smaller pages if we upload a lot more than what is read, e.g. for small framebuffers and textures.
+	// Larger pages if reads are large, and page walks dominate. Doubling the page size adds less
+	// over-fetch than what makes us halve it again, so this does not oscillate.
+	unsigned page_size = incoherent.page_size;
+	uint64_t marked_bytes = incoherent.marked_read_pages * page_size;
+	uint64_t pages_per_flush = incoherent.marked_read_pages / incoherent.flushes_since_adapt;
+
+	if (page_size > ImplementationConstants::MinIncoherentPageSize &&
+	    2 * marked_bytes > 3 * incoherent.requested_read_bytes)
+	{
+		page_size /= 2;
+	}
+	else if (page_size < ImplementationConstants::MaxIncoherentPageSize &&
+	         10 * marked_bytes < 11 * incoherent.requested_read_bytes &&
+	         pages_per_flush > ImplementationConstants::TargetIncoherentPagesPerFlush)
+	{
+		page_size *= 2;
+	}
+
+	incoherent.requested_read_bytes = 0;
+	incoherent.marked_read_pages = 0;
+	incoherent.flushes_since_adapt = 0;
+
+	// Try again later if the GPU has writes in flight.
+	if (page_size != incoherent.page_size && incoherent_pages_are_idle())
+	{
+		LOGI("Adapting RDRAM coherency page size from %u to %u bytes.\n", incoherent.page_size, page_size);
+		set_incoherent_page_size(page_size);
+	}
+}
+
+void Renderer::init_dirty_page_tracking()
+{
+	std::unique_ptr<DirtyPageTracker> tracker(new DirtyPageTracker);
+	if (!tracker->init(incoherent.host_rdram, rdram_size))
+		return;
+
+	// The tracker reports every page as dirty the first time around, since GPU RDRAM starts out as zero.
+	incoherent.page_to_cpu_dirty.clear();
+	incoherent.page_to_cpu_dirty.resize(incoherent.page_to_direct_copy.size());
+	incoherent.dirty_tracker = std::move(tracker);
+	LOGI("Tracking CPU writes to RDRAM with %u byte pages.\n", unsigned(incoherent.dirty_tracker->get_page_size()));
+}
+
 void Renderer::set_hidden_rdram(Vulkan::Buffer *buffer)
 {
 	hidden_rdram = buffer;
@@ -671,15 +853,55 @@ void Renderer::set_tmem(Vulkan::Buffer *buffer)
 
 void Renderer::flush_and_signal()
 {
-	flush_queues();
-	submit_to_queue();
+	flush_queues(FlushReason::Synchronize);
+	submit_to_queue(SubmitReason::Synchronize);
 	assert(!stream.cmd);
 }
 
+void Renderer::set_flush_policy(const FlushPolicy &policy)
+{
+	flush_policy = policy;
+}
+
+const char *get_flush_reason_name(FlushReason reason)
+{
+	switch (reason)
+	{
+	case FlushReason::StateCacheFull: return "state-cache-full";
+	case FlushReason::PrimitivesFull: return "primitives-full";
+	case FlushReason::SpanInfoFull: return "span-info-full";
+	case FlushReason::ShadedTilesFull: return "shaded-tiles-full";
+	case FlushReason::TMEMUploadsFull: return "tmem-uploads-full";
+	case FlushReason::TMEMFramebufferHazard: return "tmem-framebuffer-hazard";
+	case FlushReason::FramebufferChanged: return "framebuffer-changed";
+	case FlushReason::FramebufferConflict: return "framebuffer-conflict";
+	case FlushReason::IdleCommandThread: return "idle-command-thread";
+	case FlushReason::Synchronize: return "synchronize";
+	default: return "unknown";
+	}
+}
+
+const char *get_submit_reason_name(SubmitReason reason)
+{
+	switch (reason)
+	{
+	case SubmitReason::PendingRenderPasses: return "pending-render-passes";
+	case SubmitReason::PendingPrimitives: return "pending-primitives";
+	case SubmitReason::GPUIdle: return "gpu-idle";
+	case SubmitReason::Timeout: return "timeout";
+	case SubmitReason::RenderBufferRingFull: return "render-buffer-ring-full";
+	case SubmitReason::StagingRingFull: return "staging-ring-full";
+	case SubmitReason::IdleCommandThread: return "idle-command-thread";
+	case SubmitReason::Synchronize: return "synchronize";
+	default: return "unknown";
+	}
+}
+
 void Renderer::set_color_framebuffer(uint32_t addr, uint32_t width, FBFormat fmt)
 {
 	if (fb.addr != addr || fb.width != width || fb.fmt != fmt)
-		flush_queues();
+		if (!park_framebuffer_target())
+			flush_queues(FlushReason::FramebufferChanged);
 
 	fb.addr = addr;
 	fb.width = width;
@@ -689,7 +911,8 @@ void Renderer::set_color_framebuffer(uint32_t addr, uint32_t width, FBFormat fmt
 void Renderer::set_depth_framebuffer(uint32_t addr)
 {
 	if (fb.depth_addr != addr)
-		flush_queues();
+		if (!park_framebuffer_target())
+			flush_queues(FlushReason::FramebufferChanged);
 
 	fb.depth_addr = addr;
 }
@@ -751,9 +974,10 @@ static void encode_alpha(uint8_t *rgba, uint32_t color)
 	rgba[3] = uint8_t(color);
 }
 
-void Renderer::build_combiner_constants(DerivedSetup &setup, unsigned cycle) const
+void Renderer::build_combiner_constants(DerivedSetup &setup, const DerivedSetupState &state, unsigned cycle)
 {
-	auto &comb = stream.static_raster_state.combiner[cycle];
+	auto &comb = state.combiner[cycle];
+	auto &constants = state.constants;
 	auto &output = setup.constants[cycle];
 
 	switch (comb.rgb.muladd)
@@ -907,8 +1131,9 @@ void Renderer::build_combiner_constants(DerivedSetup &setup, unsigned cycle) con
 	}
 }
 
-DerivedSetup Renderer::build_derived_attributes(const AttributeSetup &attr) const
+DerivedSetup Renderer::build_derived_attributes(const DerivedSetupInput &input, const DerivedSetupState &state)
 {
+	auto &constants = state.constants;
 	DerivedSetup setup = {};
 	if (constants.use_prim_depth)
 	{
@@ -917,16 +1142,16 @@ DerivedSetup Renderer::build_derived_attributes(const AttributeSetup &attr) cons
 	}
 	else
 	{
-		int dzdx = attr.dzdx >> 16;
-		int dzdy = attr.dzdy >> 16;
+		int dzdx = input.dzdx >> 16;
+		int dzdy = input.dzdy >> 16;
 		int dzpix = (dzdx < 0 ? (~dzdx & 0x7fff) : dzdx) + (dzdy < 0 ? (~dzdy & 0x7fff) : dzdy);
 		dzpix = normalize_dzpix(dzpix);
 		setup.dz = dzpix;
 		setup.dz_compressed = dz_compress(dzpix);
 	}
 
-	build_combiner_constants(setup, 0);
-	build_combiner_constants(setup, 1);
+	build_combiner_constants(setup, state, 0);
+	build_combiner_constants(setup, state, 1);
 
 	setup.fog_color[0] = uint8_t(constants.fog_color >> 24);
 	setup.fog_color[1] = uint8_t(constants.fog_color >> 16);
@@ -947,6 +1172,39 @@ DerivedSetup Renderer::build_derived_attributes(const AttributeSetup &attr) cons
 	return setup;
 }
 
+void Renderer::build_derived_setups()
+{
+	unsigned count = stream.derived_setup_inputs.size();
+	if (!count)
+		return;
+
+	const auto *inputs = stream.derived_setup_inputs.data();
+	const auto *states = stream.derived_setup_state_cache.data();
+	auto *setups = stream.derived_setup.allocate(count);
+
+	const auto build_range = [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+		{
+			// The destination is likely write-combined memory, so write each setup in one go.
+			auto setup = build_derived_attributes(inputs[i], states[inputs[i].state_index]);
+			memcpy(&setups[i], &setup, sizeof(setup));
+		}
+	};
+
+	// Waking up helper threads is not free, so small render passes are built serially.
+	constexpr unsigned MinPrimitivesPerTask = 64;
+	unsigned num_tasks = derived_setup_pool ? std::min(derived_setup_pool->get_num_threads(), count / MinPrimitivesPerTask) : 1u;
+
+	if (num_tasks > 1)
+	{
+		derived_setup_pool->run(num_tasks, [&](unsigned task) {
+			build_range(count * task / num_tasks, count * (task + 1) / num_tasks);
+		});
+	}
+	else
+		build_range(0, count);
+}
+
 static constexpr unsigned SUBPIXELS_Y = 4;
 
 static int32_t clamp_int32(int64_t v)
@@ -1470,17 +1728,27 @@ void Renderer::draw_shaded_primitive(TriangleSetup &setup, const AttributeSetup
 
 	unsigned num_tiles = compute_conservative_max_num_tiles(setup);
 
-#if 0
-	// Don't exit early, throws off seeding of noise channels.
-	if (!num_tiles)
+	// The primitive cannot write anything, but it still consumes a noise seed.
+	// Later primitives in the render pass account for it through InstanceIndices::noise_offset.
+	if (!num_tiles && caps.cull_empty_primitives)
+	{
+		stream.culled_primitives++;
+		processor.frame_stats.culled_primitives++;
 		return;
-#endif
+	}
+
+	if (!bind_framebuffer_target(setup))
+	{
+		flush_queues(FlushReason::FramebufferConflict);
+		bind_framebuffer_target(setup);
+	}
 
 	if (!caps.ubershader)
 		stream.max_shaded_tiles += num_tiles;
 
 	update_deduced_height(setup);
-	stream.span_info_offsets.add(allocate_span_jobs(setup));
+	auto span_offsets = allocate_span_jobs(setup);
+	stream.span_info_offsets.add(span_offsets);
 	stream.triangle_setup.add(setup);
 
 	if (constants.use_prim_depth)
@@ -1497,7 +1765,32 @@ void Renderer::draw_shaded_primitive(TriangleSetup &setup, const AttributeSetup
 		stream.attribute_setup.add(attr);
 	}
 
-	stream.derived_setup.add(build_derived_attributes(attr));
+	// Derived state is built for the entire render pass in flush_queues().
+	DerivedSetupState derived_state;
+	// Clear padding as well, since states are hashed and compared bytewise.
+	// Constants has padding of its own, so copy it member-wise rather than overwriting the cleared padding.
+	memset(static_cast<void *>(&derived_state), 0, sizeof(derived_state));
+	auto &derived_constants = derived_state.constants;
+	derived_constants.blend_color = constants.blend_color;
+	derived_constants.fog_color = constants.fog_color;
+	derived_constants.env_color = constants.env_color;
+	derived_constants.primitive_color = constants.primitive_color;
+	derived_constants.fill_color = constants.fill_color;
+	derived_constants.min_level = constants.min_level;
+	derived_constants.prim_lod_frac = constants.prim_lod_frac;
+	derived_constants.prim_depth = constants.prim_depth;
+	derived_constants.prim_dz = constants.prim_dz;
+	memcpy(derived_constants.convert, constants.convert, sizeof(constants.convert));
+	memcpy(derived_constants.key_width, constants.key_width, sizeof(constants.key_width));
+	memcpy(derived_constants.key_center, constants.key_center, sizeof(constants.key_center));
+	memcpy(derived_constants.key_scale, constants.key_scale, sizeof(constants.key_scale));
+	derived_constants.use_prim_depth = constants.use_prim_depth;
+	memcpy(derived_state.combiner, stream.static_raster_state.combiner, sizeof(derived_state.combiner));
+	DerivedSetupInput derived_input = {};
+	derived_input.dzdx = attr.dzdx;
+	derived_input.dzdy = attr.dzdy;
+	derived_input.state_index = stream.derived_setup_state_cache.add(derived_state);
+	stream.derived_setup_inputs.add(derived_input);
 	stream.scissor_setup.add(stream.scissor_state);
 
 	deduce_static_texture_state(setup.tile & 7, setup.tile >> 3);
@@ -1507,28 +1800,35 @@ void Renderer::draw_shaded_primitive(TriangleSetup &setup, const AttributeSetup
 	indices.static_index = stream.static_raster_state_cache.add(normalize_static_state(stream.static_raster_state));
 	indices.depth_blend_index = stream.depth_blend_state_cache.add(stream.depth_blend_state);
 	indices.tile_instance_index = uint8_t(stream.tmem_upload_infos.size());
+	indices.target_index = uint8_t(stream.active_target);
+	indices.noise_offset = stream.culled_primitives;
 	for (unsigned i = 0; i < 8; i++)
 		indices.tile_indices[i] = stream.tile_info_state_cache.add(tiles[i]);
 	stream.state_indices.add(indices);
 
-	fb.color_write_pending = true;
-	if (stream.depth_blend_state.flags & DEPTH_BLEND_DEPTH_UPDATE_BIT)
-		fb.depth_write_pending = true;
+	track_framebuffer_access(span_offsets);
 	pending_primitives++;
 
-	if (need_flush())
-		flush_queues();
+	FlushReason reason;
+	if (need_flush(reason))
+		flush_queues(reason);
 }
 
-SpanInfoOffsets Renderer::allocate_span_jobs(const TriangleSetup &setup)
+bool Renderer::compute_active_lines(const TriangleSetup &setup, int &min_active_line, int &max_active_line) const
 {
 	int min_active_sub_scanline = std::max(int(setup.yh), int(stream.scissor_state.ylo));
-	int min_active_line = min_active_sub_scanline >> 2;
+	min_active_line = min_active_sub_scanline >> 2;
 
 	int max_active_sub_scanline = std::min(setup.yl - 1, int(stream.scissor_state.yhi) - 1);
-	int max_active_line = max_active_sub_scanline >> 2;
+	max_active_line = max_active_sub_scanline >> 2;
+
+	return max_active_line >= min_active_line;
+}
 
-	if (max_active_line < min_active_line)
+SpanInfoOffsets Renderer::allocate_span_jobs(const TriangleSetup &setup)
+{
+	int min_active_line, max_active_line;
+	if (!compute_active_lines(setup, min_active_line, max_active_line))
 		return { 0, 0, -1, 0 };
 
 	// Need to poke into next scanline validation for certain workarounds.
@@ -1561,7 +1861,7 @@ void Renderer::update_deduced_height(const TriangleSetup &setup)
 	fb.deduced_height = std::max(fb.deduced_height, uint32_t(height));
 }
 
-bool Renderer::need_flush() const
+bool Renderer::need_flush(FlushReason &reason) const
 {
 	bool cache_full =
 			stream.static_raster_state_cache.full() ||
@@ -1575,35 +1875,65 @@ bool Renderer::need_flush() const
 	bool max_shaded_tiles =
 			(stream.max_shaded_tiles + caps.max_tiles_x * caps.max_tiles_y > caps.max_num_tile_instances);
 
-#ifdef VULKAN_DEBUG
 	if (cache_full)
-		LOGI("Cache is full.\n");
-	if (triangle_full)
-		LOGI("Triangle is full.\n");
-	if (span_info_full)
-		LOGI("Span info is full.\n");
-	if (max_shaded_tiles)
-		LOGI("Shaded tiles is full.\n");
-#endif
+		reason = FlushReason::StateCacheFull;
+	else if (triangle_full)
+		reason = FlushReason::PrimitivesFull;
+	else if (span_info_full)
+		reason = FlushReason::SpanInfoFull;
+	else if (max_shaded_tiles)
+		reason = FlushReason::ShadedTilesFull;
+	else
+		return false;
 
-	return cache_full || triangle_full || span_info_full || max_shaded_tiles;
+	return true;
 }
 
 template <typename Cache>
 void Renderer::RenderBuffersUpdater::upload(Vulkan::CommandBuffer &cmd, Vulkan::Device &device,
-                                            const MappedBuffer &gpu, const MappedBuffer &cpu, const Cache &cache,
-                                            bool &did_upload)
+                                            RenderBufferType type, const Cache &cache, bool &did_upload)
 {
 	if (!cache.empty())
 	{
-		memcpy(device.map_host_buffer(*cpu.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT), cache.data(), cache.byte_size());
-		device.unmap_host_buffer(*cpu.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
-		if (gpu.buffer != cpu.buffer)
+		auto &cpu_buffer = cpu.buffers[unsigned(type)];
+		auto &gpu_buffer = gpu.buffers[unsigned(type)];
+		VkDeviceSize offset = get_offset(type);
+
+		// Stream caches are normally written in-place, and only need the flush in unmap.
+		auto *mapped = static_cast<uint8_t *>(device.map_host_buffer(*cpu_buffer.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT)) + offset;
+		if (mapped != static_cast<const void *>(cache.data()))
+			memcpy(mapped, cache.data(), cache.byte_size());
+		device.unmap_host_buffer(*cpu_buffer.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+		if (gpu_buffer.buffer != cpu_buffer.buffer)
 		{
-			cmd.copy_buffer(*gpu.buffer, 0, *cpu.buffer, 0, cache.byte_size());
+			cmd.copy_buffer(*gpu_buffer.buffer, offset, *cpu_buffer.buffer, offset, cache.byte_size());
 			did_upload = true;
 		}
 	}
+
+	// Only the space which was actually used is consumed from the ring.
+	auto &ring = rings[unsigned(type)];
+	ring.end = ring.begin + ((cache.byte_size() + alignment - 1) & ~(alignment - 1));
+}
+
+template <typename T, unsigned N>
+void Renderer::RenderBuffersUpdater::bind_stream_storage(Vulkan::Device &device, RenderBufferType type,
+                                                         StreamCache<T, N> &cache)
+{
+	auto *mapped = static_cast<uint8_t *>(device.map_host_buffer(*cpu.buffers[unsigned(type)].buffer, 0));
+	cache.set_storage(reinterpret_cast<T *>(mapped + get_offset(type)));
+}
+
+void Renderer::RenderBuffersUpdater::bind_stream_storage(Vulkan::Device &device, Renderer::StreamCaches &caches)
+{
+	// The state caches are searched on every lookup, so they stay in cached memory and are copied on upload.
+	bind_stream_storage(device, RenderBufferType::TriangleSetup, caches.triangle_setup);
+	bind_stream_storage(device, RenderBufferType::AttributeSetup, caches.attribute_setup);
+	bind_stream_storage(device, RenderBufferType::DerivedSetup, caches.derived_setup);
+	bind_stream_storage(device, RenderBufferType::ScissorSetup, caches.scissor_setup);
+	bind_stream_storage(device, RenderBufferType::StateIndices, caches.state_indices);
+	bind_stream_storage(device, RenderBufferType::SpanInfoOffsets, caches.span_info_offsets);
+	bind_stream_storage(device, RenderBufferType::SpanInfoJobs, caches.span_info_jobs);
 }
 
 void Renderer::RenderBuffersUpdater::upload(Vulkan::Device &device, const Renderer::StreamCaches &caches,
@@ -1611,18 +1941,18 @@ void Renderer::RenderBuffersUpdater::upload(Vulkan::Device &device, const Render
 {
 	bool did_upload = false;
 
-	upload(cmd, device, gpu.triangle_setup, cpu.triangle_setup, caches.triangle_setup, did_upload);
-	upload(cmd, device, gpu.attribute_setup, cpu.attribute_setup, caches.attribute_setup, did_upload);
-	upload(cmd, device, gpu.derived_setup, cpu.derived_setup, caches.derived_setup, did_upload);
-	upload(cmd, device, gpu.scissor_setup, cpu.scissor_setup, caches.scissor_setup, did_upload);
+	upload(cmd, device, RenderBufferType::TriangleSetup, caches.triangle_setup, did_upload);
+	upload(cmd, device, RenderBufferType::AttributeSetup, caches.attribute_setup, did_upload);
+	upload(cmd, device, RenderBufferType::DerivedSetup, caches.derived_setup, did_upload);
+	upload(cmd, device, RenderBufferType::ScissorSetup, caches.scissor_setup, did_upload);
 
-	upload(cmd, device, gpu.static_raster_state, cpu.static_raster_state, caches.static_raster_state_cache, did_upload);
-	upload(cmd, device, gpu.depth_blend_state, cpu.depth_blend_state, caches.depth_blend_state_cache, did_upload);
-	upload(cmd, device, gpu.tile_info_state, cpu.tile_info_state, caches.tile_info_state_cache, did_upload);
+	upload(cmd, device, RenderBufferType::StaticRasterState, caches.static_raster_state_cache, did_upload);
+	upload(cmd, device, RenderBufferType::DepthBlendState, caches.depth_blend_state_cache, did_upload);
+	upload(cmd, device, RenderBufferType::TileInfoState, caches.tile_info_state_cache, did_upload);
 
-	upload(cmd, device, gpu.state_indices, cpu.state_indices, caches.state_indices, did_upload);
-	upload(cmd, device, gpu.span_info_offsets, cpu.span_info_offsets, caches.span_info_offsets, did_upload);
-	upload(cmd, device, gpu.span_info_jobs, cpu.span_info_jobs, caches.span_info_jobs, did_upload);
+	upload(cmd, device, RenderBufferType::StateIndices, caches.state_indices, did_upload);
+	upload(cmd, device, RenderBufferType::SpanInfoOffsets, caches.span_info_offsets, did_upload);
+	upload(cmd, device, RenderBufferType::SpanInfoJobs, caches.span_info_jobs, did_upload);
 
 	if (did_upload)
 	{
@@ -1670,10 +2000,9 @@ void Renderer::update_tmem_instances(Vulkan::CommandBuffer &cmd)
 void Renderer::submit_span_setup_jobs(Vulkan::CommandBuffer &cmd, bool upscale)
 {
 	cmd.begin_region("span-setup");
-	auto &instance = buffer_instances[buffer_instance];
-	cmd.set_storage_buffer(0, 0, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(0, 1, *instance.gpu.attribute_setup.buffer);
-	cmd.set_storage_buffer(0, 2, *instance.gpu.scissor_setup.buffer);
+	render_buffers.bind_storage_buffer(cmd, 0, 0, RenderBufferType::TriangleSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 1, RenderBufferType::AttributeSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 2, RenderBufferType::ScissorSetup);
 	cmd.set_storage_buffer(0, 3, *span_setups);
 
 #ifdef PARALLEL_RDP_SHADER_DIR
@@ -1682,7 +2011,10 @@ void Renderer::submit_span_setup_jobs(Vulkan::CommandBuffer &cmd, bool upscale)
 	cmd.set_program(shader_bank->span_setup);
 #endif
 
-	cmd.set_buffer_view(1, 0, *instance.gpu.span_info_jobs_view);
+	// The view covers the entire ring, so the render pass' jobs are located with an offset.
+	uint32_t job_offset = uint32_t(render_buffers.get_offset(RenderBufferType::SpanInfoJobs) / sizeof(SpanInterpolationJob));
+	cmd.set_buffer_view(1, 0, *render_buffers.gpu.span_info_jobs_view);
+	cmd.push_constants(&job_offset, 0, sizeof(job_offset));
 	cmd.set_specialization_constant_mask(3);
 	cmd.set_specialization_constant(0, (upscale ? caps.upscaling : 1) * ImplementationConstants::DefaultWorkgroupSize);
 	cmd.set_specialization_constant(1, upscale ? Util::trailing_zeroes(caps.upscaling) : 0u);
@@ -1718,20 +2050,71 @@ void Renderer::clear_indirect_buffer(Vulkan::CommandBuffer &cmd)
 	cmd.end_region();
 }
 
+void Renderer::set_rasterizer_program(Vulkan::CommandBuffer &cmd)
+{
+#ifdef PARALLEL_RDP_SHADER_DIR
+	cmd.set_program("rdp://rasterizer.comp", {
+		{ "DEBUG_ENABLE", debug_channel ? 1 : 0 },
+		{ "SMALL_TYPES", caps.supports_small_integer_arithmetic ? 1 : 0 },
+	});
+#else
+	cmd.set_program(shader_bank->rasterizer);
+#endif
+
+	cmd.set_specialization_constant(0, ImplementationConstants::TileWidth);
+	cmd.set_specialization_constant(1, ImplementationConstants::TileHeight);
+}
+
+void Renderer::set_rasterizer_variant(Vulkan::CommandBuffer &cmd, const RasterizerVariant &variant)
+{
+	for (unsigned i = 0; i < RasterizerVariant::NumConstants; i++)
+		cmd.set_specialization_constant(2 + i, variant.constants[i]);
+	cmd.set_specialization_constant_mask(0xff);
+}
+
+void Renderer::precompile_rasterizer_variants()
+{
+	if (caps.ubershader || caps.force_sync)
+		return;
+
+	auto variants = shared_context->get_rasterizer_variants();
+	if (variants.empty())
+		return;
+
+	// Nothing is recorded, the command buffer is only used to build pipeline state.
+	auto cmd = device->request_command_buffer(Vulkan::CommandBuffer::Type::AsyncCompute);
+	set_rasterizer_program(*cmd);
+
+	unsigned num_queued = 0;
+	for (auto &variant : variants)
+	{
+		set_rasterizer_variant(*cmd, variant);
+		if (!cmd->flush_pipeline_state_without_blocking())
+		{
+			Vulkan::DeferredPipelineCompile compile;
+			cmd->extract_pipeline_state(compile);
+			shared_context->compile_pipeline_async(std::move(compile), 0);
+			num_queued++;
+		}
+	}
+
+	device->submit_discard(cmd);
+	LOGI("Precompiling %u rasterizer variants in the background.\n", num_queued);
+}
+
 void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem, bool upscaling)
 {
 	cmd.begin_region("rasterization");
-	auto &instance = buffer_instances[buffer_instance];
-
-	cmd.set_storage_buffer(0, 0, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(0, 1, *instance.gpu.attribute_setup.buffer);
-	cmd.set_storage_buffer(0, 2, *instance.gpu.derived_setup.buffer);
-	cmd.set_storage_buffer(0, 3, *instance.gpu.static_raster_state.buffer);
-	cmd.set_storage_buffer(0, 4, *instance.gpu.state_indices.buffer);
-	cmd.set_storage_buffer(0, 5, *instance.gpu.span_info_offsets.buffer);
+
+	render_buffers.bind_storage_buffer(cmd, 0, 0, RenderBufferType::TriangleSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 1, RenderBufferType::AttributeSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 2, RenderBufferType::DerivedSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 3, RenderBufferType::StaticRasterState);
+	render_buffers.bind_storage_buffer(cmd, 0, 4, RenderBufferType::StateIndices);
+	render_buffers.bind_storage_buffer(cmd, 0, 5, RenderBufferType::SpanInfoOffsets);
 	cmd.set_storage_buffer(0, 6, *span_setups);
 	cmd.set_storage_buffer(0, 7, tmem);
-	cmd.set_storage_buffer(0, 8, *instance.gpu.tile_info_state.buffer);
+	render_buffers.bind_storage_buffer(cmd, 0, 8, RenderBufferType::TileInfoState);
 
 	cmd.set_storage_buffer(0, 9, *per_tile_shaded_color);
 	cmd.set_storage_buffer(0, 10, *per_tile_shaded_depth);
@@ -1769,17 +2152,7 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 
 	global_fb_info->base_primitive_index = base_primitive_index;
 
-#ifdef PARALLEL_RDP_SHADER_DIR
-	cmd.set_program("rdp://rasterizer.comp", {
-		{ "DEBUG_ENABLE", debug_channel ? 1 : 0 },
-		{ "SMALL_TYPES", caps.supports_small_integer_arithmetic ? 1 : 0 },
-	});
-#else
-	cmd.set_program(shader_bank->rasterizer);
-#endif
-
-	cmd.set_specialization_constant(0, ImplementationConstants::TileWidth);
-	cmd.set_specialization_constant(1, ImplementationConstants::TileHeight);
+	set_rasterizer_program(cmd);
 
 	Vulkan::QueryPoolHandle start_ts, end_ts;
 	if (caps.timestamp >= 2)
@@ -1794,29 +2167,29 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 		                       sizeof(TileRasterWork) * caps.max_num_tile_instances);
 
 		auto &state = stream.static_raster_state_cache.data()[i];
-		cmd.set_specialization_constant(2, state.flags | RASTERIZATION_USE_SPECIALIZATION_CONSTANT_BIT | scale_log2_bit);
-		cmd.set_specialization_constant(3, state.combiner[0].rgb);
-		cmd.set_specialization_constant(4, state.combiner[0].alpha);
-		cmd.set_specialization_constant(5, state.combiner[1].rgb);
-		cmd.set_specialization_constant(6, state.combiner[1].alpha);
-
-		cmd.set_specialization_constant(7, state.dither |
-		                                   (state.texture_size << 8u) |
-		                                   (state.texture_fmt << 16u));
-		cmd.set_specialization_constant_mask(0xff);
+		RasterizerVariant variant;
+		variant.constants[0] = state.flags | RASTERIZATION_USE_SPECIALIZATION_CONSTANT_BIT | scale_log2_bit;
+		static_assert(sizeof(state.combiner) == 4 * sizeof(uint32_t), "Unexpected combiner layout.");
+		// RGB and alpha inputs for cycle 0, then cycle 1.
+		memcpy(&variant.constants[1], state.combiner, sizeof(state.combiner));
+		variant.constants[5] = state.dither | (state.texture_size << 8u) | (state.texture_fmt << 16u);
+		set_rasterizer_variant(cmd, variant);
 
 		if (!caps.force_sync && !cmd.flush_pipeline_state_without_blocking())
 		{
 			Vulkan::DeferredPipelineCompile compile;
 			cmd.extract_pipeline_state(compile);
-			if (pending_async_pipelines.count(compile.hash) == 0)
-			{
-				pending_async_pipelines.insert(compile.hash);
-				pipeline_worker->push(std::move(compile));
-			}
+			shared_context->compile_pipeline_async(std::move(compile));
+			shared_context->register_rasterizer_variant(variant);
 			cmd.set_specialization_constant_mask(7);
 			cmd.set_specialization_constant(2, scale_log2_bit);
+			processor.frame_stats.generic_rasterizer_dispatches++;
 		}
+		else
+			processor.frame_stats.specialized_rasterizer_dispatches++;
+
+		if (caps.record_variant_usage)
+			shared_context->record_variant_usage(variant);
 
 		cmd.dispatch_indirect(*indirect_dispatch_buffer, 4 * sizeof(uint32_t) * i);
 	}
@@ -1832,10 +2205,9 @@ void Renderer::submit_rasterization(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &
 void Renderer::submit_tile_binning_combined(Vulkan::CommandBuffer &cmd, bool upscale)
 {
 	cmd.begin_region("tile-binning-combined");
-	auto &instance = buffer_instances[buffer_instance];
-	cmd.set_storage_buffer(0, 0, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(0, 1, *instance.gpu.scissor_setup.buffer);
-	cmd.set_storage_buffer(0, 2, *instance.gpu.state_indices.buffer);
+	render_buffers.bind_storage_buffer(cmd, 0, 0, RenderBufferType::TriangleSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 1, RenderBufferType::ScissorSetup);
+	render_buffers.bind_storage_buffer(cmd, 0, 2, RenderBufferType::StateIndices);
 	cmd.set_storage_buffer(0, 3, *tile_binning_buffer);
 	cmd.set_storage_buffer(0, 4, *tile_binning_buffer_coarse);
 
@@ -1849,7 +2221,7 @@ void Renderer::submit_tile_binning_combined(Vulkan::CommandBuffer &cmd, bool ups
 	cmd.set_specialization_constant_mask(0x7f);
 	cmd.set_specialization_constant(1, ImplementationConstants::TileWidth);
 	cmd.set_specialization_constant(2, ImplementationConstants::TileHeight);
-	cmd.set_specialization_constant(3, Limits::MaxPrimitives);
+	cmd.set_specialization_constant(3, caps.max_primitives);
 	cmd.set_specialization_constant(4, upscale ? caps.max_width : Limits::MaxWidth);
 	cmd.set_specialization_constant(5, caps.max_num_tile_instances);
 	cmd.set_specialization_constant(6, upscale ? caps.upscaling : 1u);
@@ -1858,6 +2230,7 @@ void Renderer::submit_tile_binning_combined(Vulkan::CommandBuffer &cmd, bool ups
 	{
 		uint32_t width, height;
 		uint32_t num_primitives;
+		uint32_t target_index;
 	} push = {};
 	push.width = fb.width;
 	push.height = fb.deduced_height;
@@ -1869,6 +2242,7 @@ void Renderer::submit_tile_binning_combined(Vulkan::CommandBuffer &cmd, bool ups
 	}
 
 	push.num_primitives = uint32_t(stream.triangle_setup.size());
+	push.target_index = stream.render_target_index;
 	unsigned num_primitives_32 = (push.num_primitives + 31) / 32;
 
 	cmd.push_constants(&push, 0, sizeof(push));
@@ -2086,18 +2460,23 @@ void Renderer::submit_update_upscaled_domain(Vulkan::CommandBuffer &cmd, Resolve
 void Renderer::submit_depth_blend(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tmem, bool upscaled, bool force_write_mask)
 {
 	cmd.begin_region("render-pass");
-	auto &instance = buffer_instances[buffer_instance];
+
+	DepthBlendVariant variant;
+	variant.constants[0] = uint32_t(rdram_size);
+	variant.constants[1] = uint32_t(fb.fmt);
+	variant.constants[2] = uint32_t(fb.addr == fb.depth_addr);
+	variant.constants[3] = ImplementationConstants::TileWidth;
+	variant.constants[4] = ImplementationConstants::TileHeight;
+	variant.constants[5] = caps.max_primitives;
+	variant.constants[6] = upscaled ? caps.max_width : Limits::MaxWidth;
+	variant.constants[7] = uint32_t(force_write_mask || (!is_host_coherent && !upscaled)) |
+	                       ((upscaled ? Util::trailing_zeroes(caps.upscaling) : 0u) << 1u);
 
 	cmd.set_specialization_constant_mask(0xff);
-	cmd.set_specialization_constant(0, uint32_t(rdram_size));
-	cmd.set_specialization_constant(1, uint32_t(fb.fmt));
-	cmd.set_specialization_constant(2, int(fb.addr == fb.depth_addr));
-	cmd.set_specialization_constant(3, ImplementationConstants::TileWidth);
-	cmd.set_specialization_constant(4, ImplementationConstants::TileHeight);
-	cmd.set_specialization_constant(5, Limits::MaxPrimitives);
-	cmd.set_specialization_constant(6, upscaled ? caps.max_width : Limits::MaxWidth);
-	cmd.set_specialization_constant(7, uint32_t(force_write_mask || (!is_host_coherent && !upscaled)) |
-	                                   ((upscaled ? Util::trailing_zeroes(caps.upscaling) : 0u) << 1u));
+	for (unsigned i = 0; i < DepthBlendVariant::NumConstants; i++)
+		cmd.set_specialization_constant(i, variant.constants[i]);
+	if (caps.record_variant_usage)
+		shared_context->record_variant_usage(variant);
 
 	if (upscaled)
 		cmd.set_storage_buffer(0, 0, *upscaling_multisampled_rdram);
@@ -2115,17 +2494,17 @@ void Renderer::submit_depth_blend(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tm
 		cmd.set_storage_buffer(0, 7, *per_tile_offsets);
 	}
 
-	cmd.set_storage_buffer(1, 0, *instance.gpu.triangle_setup.buffer);
-	cmd.set_storage_buffer(1, 1, *instance.gpu.attribute_setup.buffer);
-	cmd.set_storage_buffer(1, 2, *instance.gpu.derived_setup.buffer);
-	cmd.set_storage_buffer(1, 3, *instance.gpu.scissor_setup.buffer);
-	cmd.set_storage_buffer(1, 4, *instance.gpu.static_raster_state.buffer);
-	cmd.set_storage_buffer(1, 5, *instance.gpu.depth_blend_state.buffer);
-	cmd.set_storage_buffer(1, 6, *instance.gpu.state_indices.buffer);
-	cmd.set_storage_buffer(1, 7, *instance.gpu.tile_info_state.buffer);
+	render_buffers.bind_storage_buffer(cmd, 1, 0, RenderBufferType::TriangleSetup);
+	render_buffers.bind_storage_buffer(cmd, 1, 1, RenderBufferType::AttributeSetup);
+	render_buffers.bind_storage_buffer(cmd, 1, 2, RenderBufferType::DerivedSetup);
+	render_buffers.bind_storage_buffer(cmd, 1, 3, RenderBufferType::ScissorSetup);
+	render_buffers.bind_storage_buffer(cmd, 1, 4, RenderBufferType::StaticRasterState);
+	render_buffers.bind_storage_buffer(cmd, 1, 5, RenderBufferType::DepthBlendState);
+	render_buffers.bind_storage_buffer(cmd, 1, 6, RenderBufferType::StateIndices);
+	render_buffers.bind_storage_buffer(cmd, 1, 7, RenderBufferType::TileInfoState);
 	cmd.set_storage_buffer(1, 8, *span_setups);
-	cmd.set_storage_buffer(1, 9, *instance.gpu.span_info_offsets.buffer);
-	cmd.set_buffer_view(1, 10, *blender_divider_buffer);
+	render_buffers.bind_storage_buffer(cmd, 1, 9, RenderBufferType::SpanInfoOffsets);
+	cmd.set_buffer_view(1, 10, shared_context->get_blender_divider_lut());
 	cmd.set_storage_buffer(1, 11, *tile_binning_buffer);
 	cmd.set_storage_buffer(1, 12, *tile_binning_buffer_coarse);
 
@@ -2177,7 +2556,7 @@ void Renderer::submit_depth_blend(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tm
 
 	push.depth_addr_index = fb.depth_addr >> 1;
 	unsigned num_primitives_32 = (stream.triangle_setup.size() + 31) / 32;
-	push.group_mask = (1u << num_primitives_32) - 1;
+	push.group_mask = num_primitives_32 >= 32 ? ~0u : ((1u << num_primitives_32) - 1);
 	cmd.push_constants(&push, 0, sizeof(push));
 
 	if (caps.ubershader)
@@ -2222,7 +2601,12 @@ void Renderer::submit_depth_blend(Vulkan::CommandBuffer &cmd, Vulkan::Buffer &tm
 
 void Renderer::submit_render_pass(Vulkan::CommandBuffer &cmd)
 {
-	bool need_render_pass = fb.width != 0 && fb.deduced_height != 0 && !stream.span_info_jobs.empty();
+	bool need_render_pass = false;
+	if (!stream.span_info_jobs.empty())
+		for (unsigned i = 0; i < stream.num_targets; i++)
+			if (stream.targets[i].width != 0 && stream.targets[i].deduced_height != 0)
+				need_render_pass = true;
+
 	bool need_tmem_upload = !stream.tmem_upload_infos.empty();
 	bool need_submit = need_render_pass || need_tmem_upload;
 	if (!need_submit)
@@ -2237,34 +2621,65 @@ void Renderer::submit_render_pass(Vulkan::CommandBuffer &cmd)
 
 	// Here we run 3 dispatches in parallel. Span setup and TMEM instances are low occupancy kind of jobs, but the binning
 	// pass should dominate here unless the workload is trivial.
+	// Span setup and TMEM instances are shared by all targets, binning and shading runs once per target.
 	if (need_render_pass)
-	{
 		submit_span_setup_jobs(cmd, false);
-		submit_tile_binning_combined(cmd, false);
-		if (caps.upscaling > 1)
-			submit_update_upscaled_domain(cmd, ResolveStage::Pre);
-	}
 
 	if (need_tmem_upload)
 		update_tmem_instances(cmd);
 
-	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | (!caps.ubershader ? VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT : 0),
-	            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
-	            (!caps.ubershader ? VK_ACCESS_INDIRECT_COMMAND_READ_BIT : 0));
+	auto bound_fb = fb;
+	bool rendered_target = false;
 
-	if (need_render_pass && !caps.ubershader)
+	for (unsigned i = 0; i < stream.num_targets; i++)
 	{
-		submit_rasterization(cmd, need_tmem_upload ? *tmem_instances : *tmem, false);
+		select_framebuffer_target(i);
+		if (!need_render_pass || fb.width == 0 || fb.deduced_height == 0)
+			continue;
+
+		// The binning and per-tile buffers are reused, wait for the previous target to complete.
+		if (rendered_target)
+		{
+			cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+			            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+		}
+
+		submit_tile_binning_combined(cmd, false);
+		if (caps.upscaling > 1)
+			submit_update_upscaled_domain(cmd, ResolveStage::Pre);
+
 		cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-		            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
-	}
+		            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | (!caps.ubershader ? VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT : 0),
+		            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+		            (!caps.ubershader ? VK_ACCESS_INDIRECT_COMMAND_READ_BIT : 0));
+
+		if (!caps.ubershader)
+		{
+			submit_rasterization(cmd, need_tmem_upload ? *tmem_instances : *tmem, false);
+			cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+			            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+		}
 
-	if (need_render_pass)
 		submit_depth_blend(cmd, need_tmem_upload ? *tmem_instances : *tmem, false, false);
 
-	if (!caps.ubershader)
-		clear_indirect_buffer(cmd);
+		if (!caps.ubershader)
+			clear_indirect_buffer(cmd);
+
+		rendered_target = true;
+	}
+
+	fb = bound_fb;
+
+	if (!rendered_target)
+	{
+		cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | (!caps.ubershader ? VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT : 0),
+		            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+		            (!caps.ubershader ? VK_ACCESS_INDIRECT_COMMAND_READ_BIT : 0));
+		if (!caps.ubershader)
+			clear_indirect_buffer(cmd);
+	}
 
 	if (render_pass_is_upscaled())
 	{
@@ -2343,7 +2758,7 @@ void Renderer::submit_render_pass_upscaled(Vulkan::CommandBuffer &cmd)
 
 void Renderer::submit_render_pass_end(Vulkan::CommandBuffer &cmd)
 {
-	base_primitive_index += uint32_t(stream.triangle_setup.size());
+	base_primitive_index += uint32_t(stream.triangle_setup.size()) + stream.culled_primitives;
 	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
 	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
@@ -2356,17 +2771,31 @@ void Renderer::maintain_queues()
 	// and also ensure that we don't spam submissions too often, causing massive bubbles on GPU.
 
 	// If we get a lot of small render passes in a row, it makes sense to batch them up, e.g. 8 at a time.
-	// If we get 2 full render passes of ~256 primitives, that's also a good indication we should flush since we're getting spammed.
+	// If we get a full render pass worth of primitives, that's also a good indication we should flush since we're getting spammed.
 	// If we have no pending submissions, the GPU is idle and there is no reason not to submit.
-	// If we haven't submitted anything in a while (1.0 ms), it's probably fine to submit again.
-	if (pending_render_passes >= ImplementationConstants::MaxPendingRenderPassesBeforeFlush ||
-	    (caps.super_sample_readback && pending_render_passes_upscaled >= ImplementationConstants::MaxPendingRenderPassesBeforeFlush) ||
-	    pending_primitives >= Limits::MaxPrimitives ||
-	    pending_primitives_upscaled >= Limits::MaxPrimitives ||
-	    active_submissions.load(std::memory_order_relaxed) == 0 ||
-	    int64_t(Util::get_current_time_nsecs() - last_submit_ns) > 1000000)
+	// If we haven't submitted anything in a while (1.0 ms by default), it's probably fine to submit again.
+	// The thresholds can be tuned with FlushPolicy.
+	unsigned max_pending_primitives = flush_policy.max_pending_primitives ?
+	                                  flush_policy.max_pending_primitives : caps.max_primitives;
+
+	if (pending_render_passes >= flush_policy.max_pending_render_passes ||
+	    (caps.super_sample_readback && pending_render_passes_upscaled >= flush_policy.max_pending_render_passes))
 	{
-		submit_to_queue();
+		submit_to_queue(SubmitReason::PendingRenderPasses);
+	}
+	else if (pending_primitives >= max_pending_primitives ||
+	         pending_primitives_upscaled >= max_pending_primitives)
+	{
+		submit_to_queue(SubmitReason::PendingPrimitives);
+	}
+	else if (flush_policy.submit_when_gpu_idle && active_submissions.load(std::memory_order_relaxed) == 0)
+	{
+		submit_to_queue(SubmitReason::GPUIdle);
+	}
+	else if (flush_policy.submit_timeout_us &&
+	         int64_t(Util::get_current_time_nsecs() - last_submit_ns) > int64_t(flush_policy.submit_timeout_us) * 1000)
+	{
+		submit_to_queue(SubmitReason::Timeout);
 	}
 }
 
@@ -2380,15 +2809,18 @@ void Renderer::unlock_command_processing()
 	idle_lock.unlock();
 }
 
-void Renderer::maintain_queues_idle()
+bool Renderer::maintain_queues_idle()
 {
 	std::lock_guard<std::mutex> holder{idle_lock};
-	if (pending_primitives >= ImplementationConstants::MinimumPrimitivesForIdleFlush ||
-	    pending_render_passes >= ImplementationConstants::MinimumRenderPassesForIdleFlush)
+	if (pending_primitives >= flush_policy.min_idle_flush_primitives ||
+	    pending_render_passes >= flush_policy.min_idle_flush_render_passes)
 	{
-		flush_queues();
-		submit_to_queue();
+		flush_queues(FlushReason::IdleCommandThread);
+		submit_to_queue(SubmitReason::IdleCommandThread);
+		return true;
 	}
+	else
+		return false;
 }
 
 void Renderer::enqueue_fence_wait(Vulkan::Fence fence)
@@ -2401,7 +2833,7 @@ void Renderer::enqueue_fence_wait(Vulkan::Fence fence)
 	last_submit_ns = Util::get_current_time_nsecs();
 }
 
-void Renderer::submit_to_queue()
+void Renderer::submit_to_queue(SubmitReason reason)
 {
 	bool pending_host_visible_render_passes =
 			(caps.super_sample_readback ? pending_render_passes_upscaled : pending_render_passes) != 0;
@@ -2415,6 +2847,7 @@ void Renderer::submit_to_queue()
 	{
 		if (pending_host_visible_render_passes)
 		{
+			processor.frame_stats.submits[unsigned(reason)]++;
 			Vulkan::Fence fence;
 			device->submit_empty(Vulkan::CommandBuffer::Type::AsyncCompute, &fence);
 			enqueue_fence_wait(fence);
@@ -2422,6 +2855,7 @@ void Renderer::submit_to_queue()
 		return;
 	}
 
+	processor.frame_stats.submits[unsigned(reason)]++;
 	bool need_host_barrier = is_host_coherent || !incoherent.staging_readback;
 
 	// If we maintain queues in-between doing 1x render pass and upscaled render pass,
@@ -2457,11 +2891,7 @@ void Renderer::submit_to_queue()
 		}
 	}
 
-	Util::for_each_bit(sync_indices_needs_flush, [&](unsigned bit) {
-		auto &sync = internal_sync[bit];
-		sync.fence = fence;
-	});
-	sync_indices_needs_flush = 0;
+	track_render_buffer_submission(std::move(fence));
 	stream.cmd.reset();
 }
 
@@ -2474,45 +2904,129 @@ void Renderer::reset_context()
 	stream.triangle_setup.reset();
 	stream.attribute_setup.reset();
 	stream.derived_setup.reset();
+	stream.derived_setup_inputs.reset();
+	stream.derived_setup_state_cache.reset();
 	stream.state_indices.reset();
 	stream.span_info_offsets.reset();
 	stream.span_info_jobs.reset();
 	stream.max_shaded_tiles = 0;
+	stream.culled_primitives = 0;
 
 	fb.deduced_height = 0;
 	fb.color_write_pending = false;
 	fb.depth_write_pending = false;
+	fb.depth_read_pending = false;
+	stream.num_targets = 0;
+	stream.has_active_target = false;
 
 	stream.tmem_upload_infos.clear();
 }
 
 void Renderer::begin_new_context()
 {
-	buffer_instance = (buffer_instance + 1) % Limits::NumSyncStates;
+	commit_render_buffers();
 	reset_context();
+	reserve_render_buffers();
 }
 
-uint32_t Renderer::get_byte_size_for_bound_color_framebuffer() const
+void Renderer::commit_render_buffers()
 {
-	unsigned pixel_count = fb.width * fb.deduced_height;
-	unsigned byte_count;
-	switch (fb.fmt)
+	// The upscaled render pass reads the same data after maintain_queues() might have submitted,
+	// so the space is not handed to a submission before the render pass has been fully recorded.
+	for (auto &ring : render_buffers.rings)
+		ring.head = std::max(ring.head, ring.end);
+}
+
+void Renderer::track_render_buffer_submission(Vulkan::Fence fence)
+{
+	bool has_pending = incoherent.staging_head != incoherent.staging_submitted;
+	for (auto &ring : render_buffers.rings)
+		if (ring.head != ring.submitted)
+			has_pending = true;
+
+	if (!has_pending)
+		return;
+
+	RenderBufferSubmission submission;
+	submission.fence = std::move(fence);
+	for (unsigned i = 0; i < unsigned(RenderBufferType::Count); i++)
+	{
+		auto &ring = render_buffers.rings[i];
+		submission.end[i] = ring.head;
+		ring.submitted = ring.head;
+	}
+	submission.staging_end = incoherent.staging_head;
+	incoherent.staging_submitted = incoherent.staging_head;
+	render_buffers.submissions.push_back(std::move(submission));
+}
+
+void Renderer::retire_render_buffer_submission()
+{
+	// Only the oldest submission needs to complete, which releases space in every ring at once.
+	auto &submission = render_buffers.submissions.front();
+	Vulkan::QueryPoolHandle start_ts, end_ts;
+	if (caps.timestamp)
+		start_ts = device->write_calibrated_timestamp();
+	submission.fence->wait();
+	if (caps.timestamp)
+	{
+		end_ts = device->write_calibrated_timestamp();
+		device->register_time_interval("RDP CPU", std::move(start_ts), std::move(end_ts), "render-pass-fence");
+	}
+
+	for (unsigned i = 0; i < unsigned(RenderBufferType::Count); i++)
+		render_buffers.rings[i].tail = submission.end[i];
+	incoherent.staging_tail = submission.staging_end;
+	render_buffers.submissions.pop_front();
+}
+
+void Renderer::reserve_render_buffers()
+{
+	for (auto &ring : render_buffers.rings)
+	{
+		// A render pass must be contiguous, so skip past the end of the ring if it would straddle it.
+		VkDeviceSize begin = ring.head;
+		VkDeviceSize offset = begin % ring.size;
+		if (offset + ring.pass_size > ring.size)
+			begin += ring.size - offset;
+
+		while (begin + ring.pass_size - ring.tail > ring.size)
+		{
+			if (render_buffers.submissions.empty())
+				submit_to_queue(SubmitReason::RenderBufferRingFull);
+			if (render_buffers.submissions.empty())
+				break;
+
+			retire_render_buffer_submission();
+		}
+
+		ring.begin = begin;
+		ring.end = begin;
+	}
+
+	// The GPU is done with the reserved space, so the stream caches can write straight into the upload buffers.
+	render_buffers.bind_stream_storage(*device, stream);
+}
+
+static unsigned get_bytes_per_pixel(FBFormat fmt)
+{
+	switch (fmt)
 	{
 	case FBFormat::RGBA8888:
-		byte_count = pixel_count * 4;
-		break;
+		return 4;
 
 	case FBFormat::RGBA5551:
 	case FBFormat::IA88:
-		byte_count = pixel_count * 2;
-		break;
+		return 2;
 
 	default:
-		byte_count = pixel_count;
-		break;
+		return 1;
 	}
+}
 
-	return byte_count;
+uint32_t Renderer::get_byte_size_for_bound_color_framebuffer() const
+{
+	return fb.width * fb.deduced_height * get_bytes_per_pixel(fb.fmt);
 }
 
 uint32_t Renderer::get_byte_size_for_bound_depth_framebuffer() const
@@ -2525,8 +3039,10 @@ void Renderer::mark_pages_for_gpu_read(uint32_t base_addr, uint32_t byte_count)
 	if (byte_count == 0)
 		return;
 
-	uint32_t start_page = base_addr / ImplementationConstants::IncoherentPageSize;
-	uint32_t end_page = (base_addr + byte_count - 1) / ImplementationConstants::IncoherentPageSize + 1;
+	uint32_t start_page = base_addr / incoherent.page_size;
+	uint32_t end_page = (base_addr + byte_count - 1) / incoherent.page_size + 1;
+	incoherent.requested_read_bytes += byte_count;
+	incoherent.marked_read_pages += end_page - start_page;
 	start_page &= incoherent.num_pages - 1;
 	end_page &= incoherent.num_pages - 1;
 
@@ -2551,8 +3067,8 @@ void Renderer::lock_pages_for_gpu_write(uint32_t base_addr, uint32_t byte_count)
 	if (byte_count == 0)
 		return;
 
-	uint32_t start_page = base_addr / ImplementationConstants::IncoherentPageSize;
-	uint32_t end_page = (base_addr + byte_count - 1) / ImplementationConstants::IncoherentPageSize + 1;
+	uint32_t start_page = base_addr / incoherent.page_size;
+	uint32_t end_page = (base_addr + byte_count - 1) / incoherent.page_size + 1;
 
 	for (uint32_t page = start_page; page < end_page; page++)
 	{
@@ -2584,10 +3100,10 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 				CoherencyCopy coherent_copy = {};
 				coherent_copy.counter_base = &incoherent.pending_writes_for_page[index];
 				coherent_copy.counters = count;
-				coherent_copy.src_offset = index * ImplementationConstants::IncoherentPageSize;
+				coherent_copy.src_offset = index * incoherent.page_size;
 				coherent_copy.mask_offset = coherent_copy.src_offset + rdram_size;
-				coherent_copy.dst_offset = index * ImplementationConstants::IncoherentPageSize;
-				coherent_copy.size = ImplementationConstants::IncoherentPageSize * count;
+				coherent_copy.dst_offset = index * incoherent.page_size;
+				coherent_copy.size = incoherent.page_size * count;
 				op.copies.push_back(coherent_copy);
 			});
 
@@ -2613,10 +3129,10 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 					incoherent.pending_writes_for_page[index + i].fetch_add(1, std::memory_order_relaxed);
 
 				VkBufferCopy copy = {};
-				copy.srcOffset = index * ImplementationConstants::IncoherentPageSize;
+				copy.srcOffset = index * incoherent.page_size;
 
 				unsigned dst_page_index = incoherent.staging_readback_index;
-				copy.dstOffset = dst_page_index * ImplementationConstants::IncoherentPageSize;
+				copy.dstOffset = dst_page_index * incoherent.page_size;
 
 				incoherent.staging_readback_index += count;
 				incoherent.staging_readback_index &= (incoherent.staging_readback_pages - 1);
@@ -2627,21 +3143,21 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 					incoherent.staging_readback_index = count;
 				}
 
-				copy.size = ImplementationConstants::IncoherentPageSize * count;
+				copy.size = incoherent.page_size * count;
 				copies.push_back(copy);
 
 				CoherencyCopy coherent_copy = {};
 				coherent_copy.counter_base = &incoherent.pending_writes_for_page[index];
 				coherent_copy.counters = count;
 				coherent_copy.src_offset = copy.dstOffset;
-				coherent_copy.dst_offset = index * ImplementationConstants::IncoherentPageSize;
-				coherent_copy.size = ImplementationConstants::IncoherentPageSize * count;
+				coherent_copy.dst_offset = index * incoherent.page_size;
+				coherent_copy.size = incoherent.page_size * count;
 
 				VkBufferCopy mask_copy = {};
-				mask_copy.srcOffset = index * ImplementationConstants::IncoherentPageSize + rdram_size;
+				mask_copy.srcOffset = index * incoherent.page_size + rdram_size;
 
 				dst_page_index = incoherent.staging_readback_index;
-				mask_copy.dstOffset = dst_page_index * ImplementationConstants::IncoherentPageSize;
+				mask_copy.dstOffset = dst_page_index * incoherent.page_size;
 
 				incoherent.staging_readback_index += count;
 				incoherent.staging_readback_index &= (incoherent.staging_readback_pages - 1);
@@ -2652,7 +3168,7 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 					incoherent.staging_readback_index = count;
 				}
 
-				mask_copy.size = ImplementationConstants::IncoherentPageSize * count;
+				mask_copy.size = incoherent.page_size * count;
 				copies.push_back(mask_copy);
 				coherent_copy.mask_offset = mask_copy.dstOffset;
 
@@ -2685,9 +3201,12 @@ void Renderer::resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::Com
 void Renderer::resolve_coherency_external(unsigned offset, unsigned length)
 {
 	mark_pages_for_gpu_read(offset, length);
+	reserve_staging_pages(filter_host_to_gpu_pages());
 	ensure_command_buffer();
 	resolve_coherency_host_to_gpu(*stream.cmd);
-	device->submit(stream.cmd);
+	Vulkan::Fence fence;
+	device->submit(stream.cmd, &fence);
+	track_render_buffer_submission(std::move(fence));
 	stream.cmd.reset();
 }
 
@@ -2706,6 +3225,95 @@ const Vulkan::Buffer *Renderer::get_upscaled_hidden_rdram_buffer() const
 	return upscaling_multisampled_hidden_rdram.get();
 }
 
+// Calls func(page, count) for every run of pages, also for runs which cross a word boundary.
+template <typename WordFunc, typename Func>
+static void for_each_page_run(size_t num_words, const WordFunc &get_word, const Func &func)
+{
+	unsigned run_page = 0;
+	unsigned run_count = 0;
+
+	for (size_t i = 0; i < num_words; i++)
+	{
+		Util::for_each_bit_range(get_word(i), [&](unsigned index, unsigned count) {
+			index += 32 * unsigned(i);
+			if (run_count && run_page + run_count == index)
+			{
+				run_count += count;
+			}
+			else
+			{
+				if (run_count)
+					func(run_page, run_count);
+				run_page = index;
+				run_count = count;
+			}
+		});
+	}
+
+	if (run_count)
+		func(run_page, run_count);
+}
+
+unsigned Renderer::allocate_staging_pages(unsigned &count)
+{
+	// A run which straddles the end of the ring is split, count is clamped to the contiguous part.
+	uint64_t offset = incoherent.staging_head % incoherent.staging_ring_size;
+	count = std::min(count, unsigned((incoherent.staging_ring_size - offset) / incoherent.page_size));
+	incoherent.staging_head += uint64_t(count) * incoherent.page_size;
+	assert(incoherent.staging_head - incoherent.staging_tail <= incoherent.staging_ring_size);
+	return unsigned(offset / incoherent.page_size);
+}
+
+unsigned Renderer::filter_host_to_gpu_pages()
+{
+	// Pages the CPU has not written to since they were last uploaded are already up to date in GPU RDRAM.
+	// GPU writes are either resolved with the mask or read back, so they never make a page stale.
+	if (incoherent.dirty_tracker)
+	{
+		incoherent.dirty_tracker->harvest_dirty_pages(incoherent.page_to_cpu_dirty.data(),
+		                                              incoherent.page_size);
+
+		size_t num_packed_pages = incoherent.page_to_cpu_dirty.size();
+		for (size_t i = 0; i < num_packed_pages; i++)
+		{
+			auto &cpu_dirty = incoherent.page_to_cpu_dirty[i];
+			auto &direct = incoherent.page_to_direct_copy[i];
+			auto &masked = incoherent.page_to_masked_copy[i];
+			processor.frame_stats.skipped_clean_rdram_pages += Util::popcount32((direct | masked) & ~cpu_dirty);
+			direct &= cpu_dirty;
+			masked &= cpu_dirty;
+			cpu_dirty &= ~(direct | masked);
+		}
+	}
+
+	// Direct copies go straight into RDRAM if it can be mapped, everything else goes through the staging ring.
+	bool direct_to_rdram = rdram->get_allocation().is_host_allocation();
+	unsigned num_staged_pages = 0;
+	for (size_t i = 0; i < incoherent.page_to_direct_copy.size(); i++)
+	{
+		uint32_t masked = incoherent.page_to_masked_copy[i];
+		num_staged_pages += Util::popcount32(masked);
+		if (!direct_to_rdram)
+			num_staged_pages += Util::popcount32(incoherent.page_to_direct_copy[i] & ~masked);
+	}
+
+	return num_staged_pages;
+}
+
+void Renderer::reserve_staging_pages(unsigned count)
+{
+	// Must happen before the command buffer is started, since making room may have to submit.
+	uint64_t required = uint64_t(count) * incoherent.page_size;
+	while (incoherent.staging_head + required - incoherent.staging_tail > incoherent.staging_ring_size)
+	{
+		if (render_buffers.submissions.empty())
+			submit_to_queue(SubmitReason::StagingRingFull);
+		if (render_buffers.submissions.empty())
+			break;
+		retire_render_buffer_submission();
+	}
+}
+
 void Renderer::resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd)
 {
 	// Now, ensure that the GPU sees a coherent view of the CPU memory writes up until now.
@@ -2721,97 +3329,116 @@ void Renderer::resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd)
 
 	std::atomic_thread_fence(std::memory_order_acquire);
 
+	// Clean pages were filtered out in filter_host_to_gpu_pages(), before staging space was reserved.
+
 	Util::SmallVector<VkBufferCopy, 1024> buffer_copies;
 	Util::SmallVector<uint32_t, 1024> masked_page_copies;
+	Util::SmallVector<uint32_t, 1024> masked_staging_pages;
 	Util::SmallVector<uint32_t, 1024> to_clear_write_mask;
 
+	const size_t num_packed_pages = incoherent.page_to_direct_copy.size();
+	const auto get_direct_pages = [&](size_t i) -> uint32_t {
+		// Pages which were also marked for a masked copy must not be overwritten directly.
+		return incoherent.page_to_direct_copy[i] & ~incoherent.page_to_masked_copy[i];
+	};
+	const auto get_masked_pages = [&](size_t i) -> uint32_t {
+		return incoherent.page_to_masked_copy[i];
+	};
+
+	unsigned uploaded_pages = 0;
+	unsigned copy_regions = 0;
+
+	auto *mapped_staging = static_cast<uint8_t *>(device->map_host_buffer(*incoherent.staging_rdram,
+	                                                                      Vulkan::MEMORY_ACCESS_WRITE_BIT));
+
+	// Calls func(page, staging_page, count) for every part of the run which is contiguous in the staging ring.
+	const auto stage_pages = [&](unsigned page, unsigned count, const auto &func) {
+		while (count)
+		{
+			unsigned staged_count = count;
+			unsigned staging_page = allocate_staging_pages(staged_count);
+			memcpy(mapped_staging + incoherent.page_size * staging_page,
+			       incoherent.host_rdram + incoherent.page_size * page,
+			       incoherent.page_size * staged_count);
+			uploaded_pages += staged_count;
+			copy_regions++;
+			func(page, staging_page, staged_count);
+			page += staged_count;
+			count -= staged_count;
+		}
+	};
+
+	const auto stage_masked_pages = [&](unsigned page, unsigned count) {
+		stage_pages(page, count, [&](unsigned staged_page, unsigned staging_page, unsigned staged_count) {
+			for (unsigned i = 0; i < staged_count; i++)
+			{
+				masked_page_copies.push_back(staged_page + i);
+				masked_staging_pages.push_back(staging_page + i);
+			}
+		});
+	};
+
 	// If we're able to map RDRAM directly, we can just memcpy straight into RDRAM if we have an unmasked copy.
 	// Important for iGPU.
 	if (rdram->get_allocation().is_host_allocation())
 	{
-		for (auto &direct : incoherent.page_to_direct_copy)
-		{
-			uint32_t base_index = 32 * (&direct - incoherent.page_to_direct_copy.data());
-			Util::for_each_bit_range(direct, [&](unsigned index, unsigned count) {
-				index += base_index;
-				auto *mapped_rdram = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                                             ImplementationConstants::IncoherentPageSize * index,
-				                                             ImplementationConstants::IncoherentPageSize * count);
-				memcpy(mapped_rdram,
-				       incoherent.host_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       ImplementationConstants::IncoherentPageSize * count);
-
-				device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                          ImplementationConstants::IncoherentPageSize * index,
-				                          ImplementationConstants::IncoherentPageSize * count);
-
-				mapped_rdram = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                                       ImplementationConstants::IncoherentPageSize * index + rdram_size,
-				                                       ImplementationConstants::IncoherentPageSize * count);
-
-				memset(mapped_rdram, 0, ImplementationConstants::IncoherentPageSize * count);
-
-				device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
-				                          ImplementationConstants::IncoherentPageSize * index + rdram_size,
-				                          ImplementationConstants::IncoherentPageSize * count);
-			});
-			direct = 0;
-		}
+		for_each_page_run(num_packed_pages, get_direct_pages, [&](unsigned index, unsigned count) {
+			auto *mapped_rdram = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
+			                                             incoherent.page_size * index,
+			                                             incoherent.page_size * count);
+			memcpy(mapped_rdram,
+			       incoherent.host_rdram + incoherent.page_size * index,
+			       incoherent.page_size * count);
 
-		auto *mapped_staging = static_cast<uint8_t *>(device->map_host_buffer(*incoherent.staging_rdram,
-		                                                                      Vulkan::MEMORY_ACCESS_WRITE_BIT));
+			device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
+			                          incoherent.page_size * index,
+			                          incoherent.page_size * count);
 
-		for (auto &indirect : incoherent.page_to_masked_copy)
-		{
-			uint32_t base_index = 32 * (&indirect - incoherent.page_to_masked_copy.data());
-			Util::for_each_bit(indirect, [&](unsigned index) {
-				index += base_index;
-				masked_page_copies.push_back(index);
-				memcpy(mapped_staging + ImplementationConstants::IncoherentPageSize * index,
-				       incoherent.host_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       ImplementationConstants::IncoherentPageSize);
-			});
-			indirect = 0;
-		}
+			mapped_rdram = device->map_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
+			                                       incoherent.page_size * index + rdram_size,
+			                                       incoherent.page_size * count);
 
-		device->unmap_host_buffer(*incoherent.staging_rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT);
-	}
-	else
-	{
-		auto *mapped_rdram = static_cast<uint8_t *>(device->map_host_buffer(*incoherent.staging_rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT));
+			memset(mapped_rdram, 0, incoherent.page_size * count);
 
-		size_t num_packed_pages = incoherent.page_to_masked_copy.size();
-		for (size_t i = 0; i < num_packed_pages; i++)
-		{
-			uint32_t base_index = 32 * i;
-			uint32_t tmp = incoherent.page_to_masked_copy[i] | incoherent.page_to_direct_copy[i];
-			Util::for_each_bit(tmp, [&](unsigned index) {
-				unsigned bit = index;
-				index += base_index;
+			device->unmap_host_buffer(*rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT,
+			                          incoherent.page_size * index + rdram_size,
+			                          incoherent.page_size * count);
 
-				if ((1u << bit) & incoherent.page_to_masked_copy[i])
-					masked_page_copies.push_back(index);
-				else
-				{
-					VkBufferCopy copy = {};
-					copy.size = ImplementationConstants::IncoherentPageSize;
-					copy.dstOffset = copy.srcOffset = index * ImplementationConstants::IncoherentPageSize;
-					buffer_copies.push_back(copy);
-					to_clear_write_mask.push_back(index);
-				}
+			uploaded_pages += count;
+			copy_regions++;
+		});
 
-				memcpy(mapped_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       incoherent.host_rdram + ImplementationConstants::IncoherentPageSize * index,
-				       ImplementationConstants::IncoherentPageSize);
+		for_each_page_run(num_packed_pages, get_masked_pages, stage_masked_pages);
+	}
+	else
+	{
+		for_each_page_run(num_packed_pages, get_direct_pages, [&](unsigned index, unsigned count) {
+			stage_pages(index, count, [&](unsigned staged_page, unsigned staging_page, unsigned staged_count) {
+				VkBufferCopy copy = {};
+				copy.size = incoherent.page_size * staged_count;
+				copy.srcOffset = incoherent.page_size * staging_page;
+				copy.dstOffset = incoherent.page_size * staged_page;
+				buffer_copies.push_back(copy);
+				for (unsigned i = 0; i < staged_count; i++)
+					to_clear_write_mask.push_back(staged_page + i);
 			});
+		});
 
-			incoherent.page_to_masked_copy[i] = 0;
-			incoherent.page_to_direct_copy[i] = 0;
-		}
+		for_each_page_run(num_packed_pages, get_masked_pages, stage_masked_pages);
+	}
+
+	device->unmap_host_buffer(*incoherent.staging_rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT);
 
-		device->unmap_host_buffer(*incoherent.staging_rdram, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+	for (size_t i = 0; i < num_packed_pages; i++)
+	{
+		incoherent.page_to_masked_copy[i] = 0;
+		incoherent.page_to_direct_copy[i] = 0;
 	}
 
+	processor.frame_stats.uploaded_rdram_pages += uploaded_pages;
+	processor.frame_stats.uploaded_rdram_bytes += uint64_t(uploaded_pages) * incoherent.page_size;
+	processor.frame_stats.rdram_upload_copy_regions += copy_regions;
+
 	if (!masked_page_copies.empty())
 	{
 #ifdef PARALLEL_RDP_SHADER_DIR
@@ -2820,8 +3447,8 @@ void Renderer::resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd)
 		cmd.set_program(shader_bank->masked_rdram_resolve);
 #endif
 		cmd.set_specialization_constant_mask(3);
-		cmd.set_specialization_constant(0, ImplementationConstants::IncoherentPageSize / 4);
-		cmd.set_specialization_constant(1, ImplementationConstants::IncoherentPageSize / 4);
+		cmd.set_specialization_constant(0, std::min(incoherent.page_size / 4, ImplementationConstants::MaxIncoherentPageWorkgroupSize));
+		cmd.set_specialization_constant(1, incoherent.page_size / 4);
 
 		cmd.set_storage_buffer(0, 0, *rdram, rdram_offset, rdram_size);
 		cmd.set_storage_buffer(0, 1, *incoherent.staging_rdram);
@@ -2839,6 +3466,9 @@ void Renderer::resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd)
 			memcpy(cmd.allocate_typed_constant_data<uint32_t>(1, 0, to_copy),
 				   masked_page_copies.data() + i,
 				   to_copy * sizeof(uint32_t));
+			memcpy(cmd.allocate_typed_constant_data<uint32_t>(1, 1, to_copy),
+				   masked_staging_pages.data() + i,
+				   to_copy * sizeof(uint32_t));
 			cmd.dispatch(to_copy, 1, 1);
 		}
 
@@ -2857,8 +3487,8 @@ void Renderer::resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd)
 		cmd.set_program(shader_bank->clear_write_mask);
 #endif
 		cmd.set_specialization_constant_mask(3);
-		cmd.set_specialization_constant(0, ImplementationConstants::IncoherentPageSize / 4);
-		cmd.set_specialization_constant(1, ImplementationConstants::IncoherentPageSize / 4);
+		cmd.set_specialization_constant(0, std::min(incoherent.page_size / 4, ImplementationConstants::MaxIncoherentPageWorkgroupSize));
+		cmd.set_specialization_constant(1, incoherent.page_size / 4);
 		cmd.set_storage_buffer(0, 0, *rdram, rdram_offset + rdram_size, rdram_size);
 		for (size_t i = 0; i < to_clear_write_mask.size(); i += 4096)
 		{
@@ -2906,50 +3536,46 @@ void Renderer::resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd)
 	cmd.end_region();
 }
 
-void Renderer::flush_queues()
+void Renderer::flush_queues(FlushReason reason)
 {
 	if (stream.tmem_upload_infos.empty() && stream.span_info_jobs.empty())
 	{
-		base_primitive_index += stream.triangle_setup.size();
+		base_primitive_index += stream.triangle_setup.size() + stream.culled_primitives;
 		reset_context();
 		return;
 	}
 
-	if (!is_host_coherent)
-	{
-		mark_pages_for_gpu_read(fb.addr, get_byte_size_for_bound_color_framebuffer());
-		mark_pages_for_gpu_read(fb.depth_addr, get_byte_size_for_bound_depth_framebuffer());
-
-		// We're going to write to these pages, so lock them down.
-		lock_pages_for_gpu_write(fb.addr, get_byte_size_for_bound_color_framebuffer());
-		lock_pages_for_gpu_write(fb.depth_addr, get_byte_size_for_bound_depth_framebuffer());
-	}
+	processor.frame_stats.flushes[unsigned(reason)]++;
 
-	auto &instance = buffer_instances[buffer_instance];
-	auto &sync = internal_sync[buffer_instance];
-	if (sync_indices_needs_flush & (1u << buffer_instance))
-		submit_to_queue();
-	sync_indices_needs_flush |= 1u << buffer_instance;
+	if (stream.has_active_target)
+		stream.targets[stream.active_target] = fb;
 
-	if (sync.fence)
+	if (!is_host_coherent)
 	{
-		Vulkan::QueryPoolHandle start_ts, end_ts;
-		if (caps.timestamp)
-			start_ts = device->write_calibrated_timestamp();
-		sync.fence->wait();
-		if (caps.timestamp)
+		adapt_incoherent_page_size();
+
+		auto bound_fb = fb;
+		for (unsigned i = 0; i < stream.num_targets; i++)
 		{
-			end_ts = device->write_calibrated_timestamp();
-			device->register_time_interval("RDP CPU", std::move(start_ts), std::move(end_ts), "render-pass-fence");
+			select_framebuffer_target(i);
+			mark_pages_for_gpu_read(fb.addr, get_byte_size_for_bound_color_framebuffer());
+			mark_pages_for_gpu_read(fb.depth_addr, get_byte_size_for_bound_depth_framebuffer());
+
+			// We're going to write to these pages, so lock them down.
+			lock_pages_for_gpu_write(fb.addr, get_byte_size_for_bound_color_framebuffer());
+			lock_pages_for_gpu_write(fb.depth_addr, get_byte_size_for_bound_depth_framebuffer());
 		}
-		sync.fence.reset();
+		fb = bound_fb;
+		reserve_staging_pages(filter_host_to_gpu_pages());
 	}
 
+	// Ring space was reserved when the context began, since the stream caches write straight into it.
 	ensure_command_buffer();
 
 	if (!is_host_coherent)
 		resolve_coherency_host_to_gpu(*stream.cmd);
-	instance.upload(*device, stream, *stream.cmd);
+	build_derived_setups();
+	render_buffers.upload(*device, stream, *stream.cmd);
 
 	// If we have super-sampled readback, then this is meaningless.
 	bool has_single_sampled_render_pass = !caps.super_sample_readback;
@@ -2968,10 +3594,6 @@ void Renderer::flush_queues()
 		{
 			maintain_queues();
 			ensure_command_buffer();
-
-			// We're going to keep reading the same data structures, so make sure
-			// we signal fence after upscaled render pass is submitted.
-			sync_indices_needs_flush |= 1u << buffer_instance;
 		}
 
 		submit_render_pass_upscaled(*stream.cmd);
@@ -2980,6 +3602,8 @@ void Renderer::flush_queues()
 	}
 
 	submit_render_pass_end(*stream.cmd);
+	processor.frame_stats.render_passes++;
+	processor.frame_stats.primitives += stream.triangle_setup.size();
 
 	begin_new_context();
 	maintain_queues();
@@ -3043,52 +3667,74 @@ void Renderer::set_tile_size(uint32_t tile, uint32_t slo, uint32_t shi, uint32_t
 	tiles[tile].size.thi = thi;
 }
 
-void Renderer::notify_idle_command_thread()
+bool Renderer::notify_idle_command_thread()
 {
-	maintain_queues_idle();
+	return maintain_queues_idle();
 }
 
-bool Renderer::tmem_upload_needs_flush(uint32_t addr) const
+void Renderer::compute_load_byte_range(const LoadTileInfo &info, uint32_t &base_addr, uint32_t &byte_size)
 {
-	// Not perfect, since TMEM upload could slice into framebuffer,
-	// but I doubt this will be an issue (famous last words ...)
+	unsigned pixel_count;
+	unsigned offset_pixels;
 
-	if (fb.color_write_pending)
+	if (info.mode == UploadMode::Block)
 	{
-		uint32_t offset = (addr - fb.addr) & (rdram_size - 1);
-		uint32_t pending_pixels = fb.deduced_height * fb.width;
+		pixel_count = (info.shi - info.slo + 1) & 0xfff;
+		offset_pixels = info.slo + info.tex_width * info.tlo;
+	}
+	else
+	{
+		unsigned max_x = ((info.shi >> 2) - (info.slo >> 2)) & 0xfff;
+		unsigned max_y = (info.thi >> 2) - (info.tlo >> 2);
+		pixel_count = max_y * info.tex_width + max_x + 1;
+		offset_pixels = (info.slo >> 2) + info.tex_width * (info.tlo >> 2);
+	}
 
-		switch (fb.fmt)
-		{
-		case FBFormat::RGBA5551:
-		case FBFormat::I8:
-			offset >>= 1;
-			break;
+	// 4bpp loads are treated as 8bpp, which is conservative.
+	unsigned size_log2 = info.size == TextureSize::Bpp4 ? 0 : unsigned(info.size) - 1;
+	byte_size = pixel_count << size_log2;
+	byte_size = (byte_size + 7) & ~7;
+	base_addr = info.tex_addr + (offset_pixels << size_log2);
+}
 
-		case FBFormat::RGBA8888:
-			offset >>= 2;
-			break;
+static bool ranges_overlap(uint32_t a, uint32_t a_size, uint32_t b, uint32_t b_size, uint32_t mask)
+{
+	// Either range must begin inside the other one. RDRAM addresses wrap around.
+	return ((a - b) & mask) < b_size || ((b - a) & mask) < a_size;
+}
 
-		default:
-			break;
-		}
+bool Renderer::framebuffer_target_overlaps(const FramebufferTarget &target, uint32_t addr, uint32_t size,
+                                           bool reads) const
+{
+	uint32_t mask = rdram_size - 1;
 
-		if (offset < pending_pixels)
+	// Color is always read and written by the same primitives, so the written rows cover reads as well.
+	if (target.color_write_pending)
+	{
+		unsigned stride = target.width * get_bytes_per_pixel(target.fmt);
+		if (ranges_overlap(addr, size, target.addr + target.color_write_ylo * stride,
+		                   (target.color_write_yhi - target.color_write_ylo) * stride, mask))
 		{
-			//LOGI("Flushing render pass due to coherent TMEM fetch from color buffer.\n");
 			return true;
 		}
 	}
 
-	if (fb.depth_write_pending)
+	unsigned depth_stride = target.width * 2;
+
+	if (target.depth_write_pending)
 	{
-		uint32_t offset = (addr - fb.depth_addr) & (rdram_size - 1);
-		uint32_t pending_pixels = fb.deduced_height * fb.width;
-		offset >>= 1;
+		if (ranges_overlap(addr, size, target.depth_addr + target.depth_write_ylo * depth_stride,
+		                   (target.depth_write_yhi - target.depth_write_ylo) * depth_stride, mask))
+		{
+			return true;
+		}
+	}
 
-		if (offset < pending_pixels)
+	if (reads && target.depth_read_pending)
+	{
+		if (ranges_overlap(addr, size, target.depth_addr + target.depth_read_ylo * depth_stride,
+		                   (target.depth_read_yhi - target.depth_read_ylo) * depth_stride, mask))
 		{
-			//LOGI("Flushing render pass due to coherent TMEM fetch from depth buffer.\n");
 			return true;
 		}
 	}
@@ -3096,6 +3742,144 @@ bool Renderer::tmem_upload_needs_flush(uint32_t addr) const
 	return false;
 }
 
+bool Renderer::tmem_upload_needs_flush(const LoadTileInfo &info) const
+{
+	if (stream.num_targets == 0)
+		return false;
+
+	// Only the scanlines which have actually been rendered to in this render pass are considered.
+	// A load which touches none of them is safe to read from RDRAM before the render pass runs.
+	uint32_t load_addr, load_size;
+	compute_load_byte_range(info, load_addr, load_size);
+
+	if (framebuffer_target_overlaps(fb, load_addr, load_size, false))
+		return true;
+
+	for (unsigned i = 0; i < stream.num_targets; i++)
+	{
+		if (stream.has_active_target && i == stream.active_target)
+			continue;
+		if (framebuffer_target_overlaps(stream.targets[i], load_addr, load_size, false))
+			return true;
+	}
+
+	return false;
+}
+
+static void extend_scanlines(bool &pending, uint32_t &ylo, uint32_t &yhi, uint32_t new_ylo, uint32_t new_yhi)
+{
+	if (!pending)
+	{
+		ylo = new_ylo;
+		yhi = new_yhi;
+		pending = true;
+	}
+	else
+	{
+		ylo = std::min(ylo, new_ylo);
+		yhi = std::max(yhi, new_yhi);
+	}
+}
+
+void Renderer::track_framebuffer_access(const SpanInfoOffsets &offsets)
+{
+	if (offsets.yhi < offsets.ylo)
+		return;
+
+	auto ylo = uint32_t(offsets.ylo);
+	auto yhi = uint32_t(offsets.yhi) + 1;
+
+	extend_scanlines(fb.color_write_pending, fb.color_write_ylo, fb.color_write_yhi, ylo, yhi);
+	if (stream.depth_blend_state.flags & DEPTH_BLEND_DEPTH_UPDATE_BIT)
+		extend_scanlines(fb.depth_write_pending, fb.depth_write_ylo, fb.depth_write_yhi, ylo, yhi);
+	if (stream.depth_blend_state.flags & DEPTH_BLEND_DEPTH_TEST_BIT)
+		extend_scanlines(fb.depth_read_pending, fb.depth_read_ylo, fb.depth_read_yhi, ylo, yhi);
+}
+
+bool Renderer::park_framebuffer_target()
+{
+	if (caps.max_render_pass_targets <= 1)
+		return false;
+
+	// Primitives recorded so far keep their target.
+	// The next primitive picks up a target again in bind_framebuffer_target().
+	if (stream.has_active_target)
+	{
+		stream.targets[stream.active_target] = fb;
+		stream.has_active_target = false;
+	}
+
+	fb.deduced_height = 0;
+	fb.color_write_pending = false;
+	fb.depth_write_pending = false;
+	fb.depth_read_pending = false;
+	return true;
+}
+
+bool Renderer::bind_framebuffer_target(const TriangleSetup &setup)
+{
+	if (!stream.has_active_target)
+	{
+		unsigned index;
+		for (index = 0; index < stream.num_targets; index++)
+		{
+			auto &target = stream.targets[index];
+			if (target.addr == fb.addr && target.depth_addr == fb.depth_addr &&
+			    target.width == fb.width && target.fmt == fb.fmt)
+			{
+				break;
+			}
+		}
+
+		if (index == stream.num_targets)
+		{
+			if (stream.num_targets == caps.max_render_pass_targets)
+				return false;
+			stream.num_targets++;
+		}
+		else
+			fb = stream.targets[index];
+
+		stream.active_target = index;
+		stream.has_active_target = true;
+	}
+
+	if (stream.num_targets <= 1)
+		return true;
+
+	// Targets are rendered one after the other, so any memory a primitive touches
+	// must not be touched by other targets in the same render pass.
+	int min_active_line, max_active_line;
+	if (!compute_active_lines(setup, min_active_line, max_active_line))
+		return true;
+
+	uint32_t ylo = min_active_line;
+	uint32_t num_lines = max_active_line - min_active_line + 1;
+	uint32_t color_stride = fb.width * get_bytes_per_pixel(fb.fmt);
+	uint32_t depth_stride = fb.width * 2;
+	bool depth = (stream.depth_blend_state.flags & (DEPTH_BLEND_DEPTH_TEST_BIT | DEPTH_BLEND_DEPTH_UPDATE_BIT)) != 0;
+
+	for (unsigned i = 0; i < stream.num_targets; i++)
+	{
+		if (i == stream.active_target)
+			continue;
+
+		auto &target = stream.targets[i];
+		if (framebuffer_target_overlaps(target, fb.addr + ylo * color_stride, num_lines * color_stride, true))
+			return false;
+		if (depth && framebuffer_target_overlaps(target, fb.depth_addr + ylo * depth_stride, num_lines * depth_stride, true))
+			return false;
+	}
+
+	return true;
+}
+
+void Renderer::select_framebuffer_target(unsigned index)
+{
+	fb = stream.targets[index];
+	stream.render_target_index = index;
+}
+
 void Renderer::load_tile(uint32_t tile, const LoadTileInfo &info)
 {
 	if (validation_iface && info.mode == UploadMode::TLUT)
@@ -3107,9 +3891,6 @@ void Renderer::load_tile(uint32_t tile, const LoadTileInfo &info)
 		}
 	}
 
-	if (tmem_upload_needs_flush(info.tex_addr))
-		flush_queues();
-
 	// Detect noop cases.
 	if (info.mode != UploadMode::Block)
 	{
@@ -3127,28 +3908,14 @@ void Renderer::load_tile(uint32_t tile, const LoadTileInfo &info)
 			return;
 	}
 
+	// Noop loads don't read anything, so they cannot hazard against pending framebuffer writes.
+	if (tmem_upload_needs_flush(info))
+		flush_queues(FlushReason::TMEMFramebufferHazard);
+
 	if (!is_host_coherent)
 	{
-		unsigned pixel_count;
-		unsigned offset_pixels;
-		unsigned base_addr = info.tex_addr;
-
-		if (info.mode == UploadMode::Block)
-		{
-			pixel_count = (info.shi - info.slo + 1) & 0xfff;
-			offset_pixels = info.slo + info.tex_width * info.tlo;
-		}
-		else
-		{
-			unsigned max_x = ((info.shi >> 2) - (info.slo >> 2)) & 0xfff;
-			unsigned max_y = (info.thi >> 2) - (info.tlo >> 2);
-			pixel_count = max_y * info.tex_width + max_x + 1;
-			offset_pixels = (info.slo >> 2) + info.tex_width * (info.tlo >> 2);
-		}
-
-		unsigned byte_size = pixel_count << (unsigned(info.size) - 1);
-		byte_size = (byte_size + 7) & ~7;
-		base_addr += offset_pixels << (unsigned(info.size) - 1);
+		uint32_t base_addr, byte_size;
+		compute_load_byte_range(info, base_addr, byte_size);
 		mark_pages_for_gpu_read(base_addr, byte_size);
 	}
 
@@ -3482,7 +4249,7 @@ void Renderer::load_tile_iteration(uint32_t tile, const LoadTileInfo &info, uint
 
 	stream.tmem_upload_infos.push_back(upload);
 	if (stream.tmem_upload_infos.size() + 1 >= Limits::MaxTMEMInstances)
-		flush_queues();
+		flush_queues(FlushReason::TMEMUploadsFull);
 }
 
 void Renderer::set_blend_color(uint32_t color)
@@ -3569,21 +4336,4 @@ bool Renderer::supports_subgroup_size_control(uint32_t minimum_size, uint32_t ma
 	return true;
 }
 
-void Renderer::PipelineExecutor::perform_work(const Vulkan::DeferredPipelineCompile &compile) const
-{
-	auto start_ts = device->write_calibrated_timestamp();
-	Vulkan::CommandBuffer::build_compute_pipeline(device, compile, Vulkan::CommandBuffer::CompileMode::AsyncThread);
-	auto end_ts = device->write_calibrated_timestamp();
-	device->register_time_interval("RDP Pipeline", std::move(start_ts), std::move(end_ts),
-	                               "pipeline-compilation");
-}
-
-bool Renderer::PipelineExecutor::is_sentinel(const Vulkan::DeferredPipelineCompile &compile) const
-{
-	return compile.hash == 0;
-}
-
-void Renderer::PipelineExecutor::notify_work_locked(const Vulkan::DeferredPipelineCompile &) const
-{
-}
 }
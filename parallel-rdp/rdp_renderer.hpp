@@ -26,11 +26,17 @@
 #include "device.hpp"
 #include "rdp_common.hpp"
 #include "worker_thread.hpp"
+#include "worker_pool.hpp"
+#include "rdp_dirty_tracker.hpp"
 #include <unordered_set>
+#include <deque>
 
 namespace RDP
 {
 struct CoherencyOperation;
+class SharedRDPContext;
+struct RasterizerVariant;
+struct DepthBlendVariant;
 
 struct SyncObject
 {
@@ -68,10 +74,75 @@ class CommandProcessor;
 struct RendererOptions
 {
 	unsigned upscaling_factor = 1;
+	// Primitives per render pass. Must be 256, 512 or 1024.
+	unsigned max_primitives = ImplementationConstants::DefaultMaxPrimitives;
+	// Number of framebuffers a render pass can render to, up to Limits::MaxRenderPassTargets.
+	// Only has an effect without upscaling.
+	unsigned max_render_pass_targets = 1;
+	// Drops primitives which cannot cover any tile before they reach the GPU. Only has an effect without upscaling.
+	bool cull_empty_primitives = true;
+	// Helper threads which build derived primitive state when a render pass is flushed.
+	// With 0, it is built on the thread which flushes.
+	unsigned derived_setup_threads = 0;
+	// Only uploads RDRAM pages the CPU has written to since they were last uploaded.
+	// Only has an effect without VK_EXT_external_memory_host, see DirtyPageTracker.
+	bool track_dirty_pages = false;
+	// Granularity of coherency between host and GPU RDRAM without VK_EXT_external_memory_host.
+	// Must be a power of two from 256 to 16 KiB. With 0, it is selected from the RDRAM size and adapted to how RDRAM is accessed.
+	unsigned incoherent_page_size = 0;
 	bool super_sampled_readback = false;
 	bool super_sampled_readback_dither = false;
 };
 
+// Controls when pending render passes are submitted to the GPU.
+struct FlushPolicy
+{
+	// Submit once this many render passes are pending.
+	unsigned max_pending_render_passes = ImplementationConstants::MaxPendingRenderPassesBeforeFlush;
+	// Submit once this many primitives are pending. 0 means one full render pass worth of primitives.
+	unsigned max_pending_primitives = 0;
+	// Submit if nothing has been submitted for this long. 0 disables the timeout.
+	unsigned submit_timeout_us = 1000;
+	// Submit right away if the GPU has no work in flight.
+	bool submit_when_gpu_idle = true;
+	// When the command thread goes idle, flush if at least this many primitives or render passes are pending.
+	unsigned min_idle_flush_primitives = ImplementationConstants::MinimumPrimitivesForIdleFlush;
+	unsigned min_idle_flush_render_passes = ImplementationConstants::MinimumRenderPassesForIdleFlush;
+};
+
+// Why a render pass was ended.
+enum class FlushReason : unsigned
+{
+	StateCacheFull = 0,
+	PrimitivesFull,
+	SpanInfoFull,
+	ShadedTilesFull,
+	TMEMUploadsFull,
+	TMEMFramebufferHazard,
+	FramebufferChanged,
+	FramebufferConflict,
+	IdleCommandThread,
+	Synchronize,
+	Count
+};
+
+// Why pending render passes were submitted to the GPU.
+enum class SubmitReason : unsigned
+{
+	PendingRenderPasses = 0,
+	PendingPrimitives,
+	GPUIdle,
+	Timeout,
+	RenderBufferRingFull,
+	StagingRingFull,
+	IdleCommandThread,
+	Synchronize,
+	Count
+};
+
+const char *get_flush_reason_name(FlushReason reason);
+const char *get_submit_reason_name(SubmitReason reason);
+
 enum class ValidationError
 {
 	Fill4bpp,
@@ -109,8 +180,11 @@ public:
 	void set_hidden_rdram(Vulkan::Buffer *buffer);
 	void set_tmem(Vulkan::Buffer *buffer);
 	void set_shader_bank(const ShaderBank *bank);
+	void set_shared_context(SharedRDPContext *context);
 
 	bool init_renderer(const RendererOptions &options);
+	// Queues up compilation of rasterizer variants seen in earlier sessions. Requires the shader bank.
+	void precompile_rasterizer_variants();
 
 	// setup may be mutated to apply various fixups to triangle setup.
 	void draw_flat_primitive(TriangleSetup &setup);
@@ -140,8 +214,10 @@ public:
 
 	// Called when the command thread has not seen any activity in a given period of time.
 	// This is useful so we don't needlessly queue up work when we might as well kick it to the GPU.
-	void notify_idle_command_thread();
+	// Returns true if work was submitted as a result.
+	bool notify_idle_command_thread();
 	void flush_and_signal();
+	void set_flush_policy(const FlushPolicy &policy);
 
 	int resolve_shader_define(const char *name, const char *define) const;
 
@@ -167,6 +243,10 @@ private:
 	Vulkan::BufferHandle upscaling_multisampled_hidden_rdram;
 
 	void validate_draw_state() const;
+	void init_dirty_page_tracking();
+	void set_incoherent_page_size(unsigned page_size);
+	bool incoherent_pages_are_idle() const;
+	void adapt_incoherent_page_size();
 
 	struct
 	{
@@ -177,9 +257,25 @@ private:
 		std::vector<uint32_t> page_to_direct_copy;
 		std::vector<uint32_t> page_to_masked_copy;
 		std::vector<uint32_t> page_to_pending_readback;
+		// Pages the CPU has written to which have not been uploaded since. Only used with dirty_tracker.
+		std::vector<uint32_t> page_to_cpu_dirty;
+		std::unique_ptr<DirtyPageTracker> dirty_tracker;
 		unsigned num_pages = 0;
+		unsigned page_size = 0;
+		// Pages are uploaded through staging_rdram, which is a ring of staging_ring_size bytes.
+		// Positions are monotonic byte counts, released with the render buffer submissions.
+		uint64_t staging_ring_size = 0;
+		uint64_t staging_head = 0;
+		uint64_t staging_tail = 0;
+		uint64_t staging_submitted = 0;
 		unsigned staging_readback_pages = 0;
 		unsigned staging_readback_index = 0; // Ringbuffer the readbacks.
+
+		// Bytes the GPU asked to read, and pages marked for it, since the page size was last adapted.
+		bool adaptive_page_size = false;
+		uint64_t requested_read_bytes = 0;
+		uint64_t marked_read_pages = 0;
+		unsigned flushes_since_adapt = 0;
 	} incoherent;
 
 	size_t rdram_offset = 0;
@@ -188,13 +284,13 @@ private:
 	Vulkan::Buffer *hidden_rdram = nullptr;
 	Vulkan::Buffer *tmem = nullptr;
 	const ShaderBank *shader_bank = nullptr;
+	SharedRDPContext *shared_context = nullptr;
 
 	bool init_caps();
-	void init_blender_lut();
 	void init_buffers(const RendererOptions &options);
 	bool init_internal_upscaling_factor(const RendererOptions &options);
 
-	struct
+	struct FramebufferTarget
 	{
 		uint32_t addr = 0;
 		uint32_t depth_addr = 0;
@@ -203,8 +299,54 @@ private:
 		FBFormat fmt = FBFormat::I8;
 		bool depth_write_pending = false;
 		bool color_write_pending = false;
+		bool depth_read_pending = false;
+
+		// Scanlines written by primitives in the current render pass, [ylo, yhi).
+		uint32_t color_write_ylo = 0;
+		uint32_t color_write_yhi = 0;
+		uint32_t depth_write_ylo = 0;
+		uint32_t depth_write_yhi = 0;
+		// Scanlines where depth is tested, but not necessarily written.
+		uint32_t depth_read_ylo = 0;
+		uint32_t depth_read_yhi = 0;
 	} fb;
 
+	struct Constants
+	{
+		uint32_t blend_color = 0;
+		uint32_t fog_color = 0;
+		uint32_t env_color = 0;
+		uint32_t primitive_color = 0;
+		uint32_t fill_color = 0;
+		uint8_t min_level = 0;
+		uint8_t prim_lod_frac = 0;
+		int32_t prim_depth = 0;
+		uint16_t prim_dz = 0;
+		uint16_t convert[6] = {};
+
+		uint16_t key_width[3] = {};
+		uint8_t key_center[3] = {};
+		uint8_t key_scale[3] = {};
+
+		bool use_prim_depth = false;
+		// When adding members, also copy them into DerivedSetupState in draw_shaded_primitive().
+	};
+
+	// Everything build_derived_attributes() depends on besides the depth slopes. This is snapshotted at draw time,
+	// so derived state can be built for all primitives at once when the render pass is flushed.
+	struct alignas(8) DerivedSetupState
+	{
+		Constants constants;
+		CombinerInputs combiner[2];
+	};
+
+	struct DerivedSetupInput
+	{
+		int32_t dzdx;
+		int32_t dzdy;
+		uint32_t state_index;
+	};
+
 	struct StreamCaches
 	{
 		ScissorState scissor_state = {};
@@ -214,17 +356,29 @@ private:
 		StateCache<StaticRasterizationState, Limits::MaxStaticRasterizationStates> static_raster_state_cache;
 		StateCache<DepthBlendState, Limits::MaxDepthBlendStates> depth_blend_state_cache;
 		StateCache<TileInfo, Limits::MaxTileInfoStates> tile_info_state_cache;
+		StateCache<DerivedSetupState, Limits::MaxPrimitives> derived_setup_state_cache;
 
 		StreamCache<TriangleSetup, Limits::MaxPrimitives> triangle_setup;
 		StreamCache<ScissorState, Limits::MaxPrimitives> scissor_setup;
 		StreamCache<AttributeSetup, Limits::MaxPrimitives> attribute_setup;
 		StreamCache<DerivedSetup, Limits::MaxPrimitives> derived_setup;
+		StreamCache<DerivedSetupInput, Limits::MaxPrimitives> derived_setup_inputs;
 		StreamCache<InstanceIndices, Limits::MaxPrimitives> state_indices;
 		StreamCache<SpanInfoOffsets, Limits::MaxPrimitives> span_info_offsets;
 		StreamCache<SpanInterpolationJob, Limits::MaxSpanSetups> span_info_jobs;
 
 		std::vector<UploadInfo> tmem_upload_infos;
 		unsigned max_shaded_tiles = 0;
+		unsigned culled_primitives = 0;
+
+		// Framebuffers rendered to in this render pass. The active target is tracked in fb while recording,
+		// and its slot here is only up to date once it is parked or flushed.
+		FramebufferTarget targets[Limits::MaxRenderPassTargets];
+		unsigned num_targets = 0;
+		unsigned active_target = 0;
+		bool has_active_target = false;
+		// Target being rendered while submitting the render pass.
+		unsigned render_target_index = 0;
 		Vulkan::CommandBufferHandle cmd;
 	} stream;
 
@@ -233,8 +387,6 @@ private:
 	TileInfo tiles[Limits::MaxNumTiles];
 	Vulkan::BufferHandle tmem_instances;
 	Vulkan::BufferHandle span_setups;
-	Vulkan::BufferHandle blender_divider_lut_buffer;
-	Vulkan::BufferViewHandle blender_divider_buffer;
 
 	Vulkan::BufferHandle tile_binning_buffer;
 	Vulkan::BufferHandle tile_binning_buffer_coarse;
@@ -253,89 +405,108 @@ private:
 		bool is_host = false;
 	};
 
+	enum class RenderBufferType
+	{
+		TriangleSetup,
+		AttributeSetup,
+		DerivedSetup,
+		ScissorSetup,
+		StaticRasterState,
+		DepthBlendState,
+		TileInfoState,
+		StateIndices,
+		SpanInfoOffsets,
+		SpanInfoJobs,
+		Count
+	};
+
 	struct RenderBuffers
 	{
-		void init(Vulkan::Device &device, Vulkan::BufferDomain domain, RenderBuffers *borrow);
+		void init(Vulkan::Device &device, Vulkan::BufferDomain domain, const VkDeviceSize *sizes, RenderBuffers *borrow);
 		static MappedBuffer create_buffer(Vulkan::Device &device, Vulkan::BufferDomain domain, VkDeviceSize size, MappedBuffer *borrow);
 
-		MappedBuffer triangle_setup;
-		MappedBuffer attribute_setup;
-		MappedBuffer derived_setup;
-		MappedBuffer scissor_setup;
-
-		MappedBuffer static_raster_state;
-		MappedBuffer depth_blend_state;
-		MappedBuffer tile_info_state;
+		MappedBuffer buffers[unsigned(RenderBufferType::Count)];
+		Vulkan::BufferViewHandle span_info_jobs_view;
+	};
 
-		MappedBuffer state_indices;
-		MappedBuffer span_info_offsets;
+	// Positions are monotonic byte counts, the offset into the buffer is position modulo size.
+	struct RenderBufferRing
+	{
+		VkDeviceSize size = 0;
+		VkDeviceSize pass_size = 0;
+		VkDeviceSize head = 0;
+		VkDeviceSize tail = 0;
+		VkDeviceSize begin = 0;
+		VkDeviceSize end = 0;
+		VkDeviceSize submitted = 0;
+	};
 
-		MappedBuffer span_info_jobs;
-		Vulkan::BufferViewHandle span_info_jobs_view;
+	struct RenderBufferSubmission
+	{
+		Vulkan::Fence fence;
+		VkDeviceSize end[unsigned(RenderBufferType::Count)];
+		uint64_t staging_end;
 	};
 
 	struct RenderBuffersUpdater
 	{
-		void init(Vulkan::Device &device);
+		void init(Vulkan::Device &device, unsigned max_primitives);
 		void upload(Vulkan::Device &device, const StreamCaches &caches, Vulkan::CommandBuffer &cmd);
+		void bind_stream_storage(Vulkan::Device &device, StreamCaches &caches);
+		void bind_storage_buffer(Vulkan::CommandBuffer &cmd, unsigned set, unsigned binding, RenderBufferType type) const;
+		VkDeviceSize get_offset(RenderBufferType type) const;
+
+		template <typename T, unsigned N>
+		void bind_stream_storage(Vulkan::Device &device, RenderBufferType type, StreamCache<T, N> &cache);
 
 		template <typename Cache>
 		void upload(Vulkan::CommandBuffer &cmd, Vulkan::Device &device,
-		            const MappedBuffer &gpu, const MappedBuffer &cpu, const Cache &cache, bool &did_upload);
+		            RenderBufferType type, const Cache &cache, bool &did_upload);
 
 		RenderBuffers cpu, gpu;
+		RenderBufferRing rings[unsigned(RenderBufferType::Count)];
+		std::deque<RenderBufferSubmission> submissions;
+		VkDeviceSize alignment = 0;
 	};
 
-	struct InternalSynchronization
-	{
-		Vulkan::Fence fence;
-	};
+	Constants constants;
 
-	struct Constants
-	{
-		uint32_t blend_color = 0;
-		uint32_t fog_color = 0;
-		uint32_t env_color = 0;
-		uint32_t primitive_color = 0;
-		uint32_t fill_color = 0;
-		uint8_t min_level = 0;
-		uint8_t prim_lod_frac = 0;
-		int32_t prim_depth = 0;
-		uint16_t prim_dz = 0;
-		uint16_t convert[6] = {};
-
-		uint16_t key_width[3] = {};
-		uint8_t key_center[3] = {};
-		uint8_t key_scale[3] = {};
-
-		bool use_prim_depth = false;
-	} constants;
-
-	RenderBuffersUpdater buffer_instances[Limits::NumSyncStates];
-	InternalSynchronization internal_sync[Limits::NumSyncStates];
-	uint32_t sync_indices_needs_flush = 0;
-	unsigned buffer_instance = 0;
+	RenderBuffersUpdater render_buffers;
 	uint32_t base_primitive_index = 0;
 	unsigned pending_render_passes = 0;
 	unsigned pending_render_passes_upscaled = 0;
 	unsigned pending_primitives = 0;
 	unsigned pending_primitives_upscaled = 0;
 
-	bool tmem_upload_needs_flush(uint32_t addr) const;
+	bool tmem_upload_needs_flush(const LoadTileInfo &info) const;
+	bool framebuffer_target_overlaps(const FramebufferTarget &target, uint32_t addr, uint32_t size, bool reads) const;
+	bool park_framebuffer_target();
+	bool bind_framebuffer_target(const TriangleSetup &setup);
+	void select_framebuffer_target(unsigned index);
+	void track_framebuffer_access(const SpanInfoOffsets &offsets);
+	static void compute_load_byte_range(const LoadTileInfo &info, uint32_t &base_addr, uint32_t &byte_size);
 
 	bool render_pass_is_upscaled() const;
 	bool should_render_upscaled() const;
 
-	void flush_queues();
+	void flush_queues(FlushReason reason);
 	void submit_render_pass(Vulkan::CommandBuffer &cmd);
 	void submit_render_pass_upscaled(Vulkan::CommandBuffer &cmd);
 	void submit_render_pass_end(Vulkan::CommandBuffer &cmd);
-	void submit_to_queue();
+	void submit_to_queue(SubmitReason reason);
 	void begin_new_context();
 	void reset_context();
-	bool need_flush() const;
+	void reserve_render_buffers();
+	void commit_render_buffers();
+	void track_render_buffer_submission(Vulkan::Fence fence);
+	void retire_render_buffer_submission();
+	unsigned filter_host_to_gpu_pages();
+	void reserve_staging_pages(unsigned count);
+	unsigned allocate_staging_pages(unsigned &count);
+	bool need_flush(FlushReason &reason) const;
+	FlushPolicy flush_policy;
 	void maintain_queues();
-	void maintain_queues_idle();
+	bool maintain_queues_idle();
 	void update_tmem_instances(Vulkan::CommandBuffer &cmd);
 	void submit_span_setup_jobs(Vulkan::CommandBuffer &cmd, bool upscaled);
 	void update_deduced_height(const TriangleSetup &setup);
@@ -353,9 +524,15 @@ private:
 	void submit_clear_super_sample_write_mask(Vulkan::CommandBuffer &cmd, unsigned width, unsigned height);
 
 	SpanInfoOffsets allocate_span_jobs(const TriangleSetup &setup);
+	bool compute_active_lines(const TriangleSetup &setup, int &min_active_line, int &max_active_line) const;
 
-	DerivedSetup build_derived_attributes(const AttributeSetup &attr) const;
-	void build_combiner_constants(DerivedSetup &setup, unsigned cycle) const;
+	void set_rasterizer_program(Vulkan::CommandBuffer &cmd);
+	static void set_rasterizer_variant(Vulkan::CommandBuffer &cmd, const RasterizerVariant &variant);
+
+	static DerivedSetup build_derived_attributes(const DerivedSetupInput &input, const DerivedSetupState &state);
+	static void build_combiner_constants(DerivedSetup &setup, const DerivedSetupState &state, unsigned cycle);
+	void build_derived_setups();
+	std::unique_ptr<WorkerPool> derived_setup_pool;
 	int filter_debug_channel_x = -1;
 	int filter_debug_channel_y = -1;
 	bool debug_channel = false;
@@ -367,8 +544,6 @@ private:
 	bool can_support_minimum_subgroup_size(unsigned size) const;
 	bool supports_subgroup_size_control(uint32_t minimum_size, uint32_t maximum_size) const;
 
-	std::unordered_set<Util::Hash> pending_async_pipelines;
-
 	unsigned compute_conservative_max_num_tiles(const TriangleSetup &setup) const;
 
 	void deduce_static_texture_state(unsigned tile, unsigned max_lod_level);
@@ -392,18 +567,12 @@ private:
 		unsigned max_tiles_y = ImplementationConstants::MaxTilesY;
 		unsigned max_width = Limits::MaxWidth;
 		unsigned max_height = Limits::MaxHeight;
+		unsigned max_primitives = ImplementationConstants::DefaultMaxPrimitives;
+		unsigned max_render_pass_targets = 1;
+		bool cull_empty_primitives = false;
+		bool record_variant_usage = false;
 	} caps;
 
-	struct PipelineExecutor
-	{
-		Vulkan::Device *device;
-		bool is_sentinel(const Vulkan::DeferredPipelineCompile &compile) const;
-		void perform_work(const Vulkan::DeferredPipelineCompile &compile) const;
-		void notify_work_locked(const Vulkan::DeferredPipelineCompile &compile) const;
-	};
-
-	std::unique_ptr<WorkerThread<Vulkan::DeferredPipelineCompile, PipelineExecutor>> pipeline_worker;
-
 	void resolve_coherency_host_to_gpu(Vulkan::CommandBuffer &cmd);
 	void resolve_coherency_gpu_to_host(CoherencyOperation &op, Vulkan::CommandBuffer &cmd);
 	uint32_t get_byte_size_for_bound_color_framebuffer() const;
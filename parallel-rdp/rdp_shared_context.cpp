@@ -0,0 +1,437 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_shared_context.hpp"
+#include "rdp_data_structures.hpp"
+#include "luts.hpp"
+#include "logging.hpp"
+#include "thread_id.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef PARALLEL_RDP_SHADER_DIR
+#include "global_managers.hpp"
+#else
+#include "shaders/slangmosh.hpp"
+#endif
+
+namespace RDP
+{
+SharedRDPContext::SharedRDPContext(Vulkan::Device &device_, unsigned num_pipeline_threads)
+	: device(device_)
+{
+	if (const char *env = getenv("PARALLEL_RDP_PIPELINE_THREADS"))
+		num_pipeline_threads = unsigned(strtoul(env, nullptr, 0));
+	if (!num_pipeline_threads)
+		num_pipeline_threads = std::max(std::thread::hardware_concurrency() / 2, 1u);
+
+	pipeline_threads.reserve(num_pipeline_threads);
+	for (unsigned i = 0; i < num_pipeline_threads; i++)
+	{
+#ifdef PARALLEL_RDP_SHADER_DIR
+		pipeline_threads.emplace_back([this, globals = Granite::Global::create_thread_context()]() mutable {
+			Granite::Global::set_thread_context(*globals);
+			globals.reset();
+			pipeline_thread_loop();
+		});
+#else
+		pipeline_threads.emplace_back(&SharedRDPContext::pipeline_thread_loop, this);
+#endif
+	}
+
+	init_luts();
+
+	if (const char *env = getenv("PARALLEL_RDP_PIPELINE_CACHE"))
+		load_pipeline_cache(env);
+}
+
+SharedRDPContext::~SharedRDPContext()
+{
+	// Make sure pipeline compilation is done before shader banks are torn down.
+	{
+		std::lock_guard<std::mutex> holder{pipeline_lock};
+		pipeline_threads_dead = true;
+		pipeline_cond.notify_all();
+	}
+
+	for (auto &thr : pipeline_threads)
+		thr.join();
+
+	if (!pipeline_cache_path.empty())
+		save_pipeline_cache();
+}
+
+Vulkan::Device &SharedRDPContext::get_device() const
+{
+	return device;
+}
+
+void SharedRDPContext::init_luts()
+{
+	Vulkan::BufferCreateInfo info = {};
+	info.domain = Vulkan::BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT;
+
+	info.size = sizeof(blender_lut);
+	blender_divider_lut_buffer = device.create_buffer(info, blender_lut);
+	device.set_name(*blender_divider_lut_buffer, "blender-divider-lut-buffer");
+
+	info.size = sizeof(gamma_table);
+	gamma_lut_buffer = device.create_buffer(info, gamma_table);
+	device.set_name(*gamma_lut_buffer, "gamma-lut-buffer");
+
+	Vulkan::BufferViewCreateInfo view = {};
+	view.format = VK_FORMAT_R8_UINT;
+
+	view.buffer = blender_divider_lut_buffer.get();
+	view.range = sizeof(blender_lut);
+	blender_divider_lut = device.create_buffer_view(view);
+
+	view.buffer = gamma_lut_buffer.get();
+	view.range = sizeof(gamma_table);
+	gamma_lut = device.create_buffer_view(view);
+}
+
+const Vulkan::BufferView &SharedRDPContext::get_blender_divider_lut() const
+{
+	return *blender_divider_lut;
+}
+
+const Vulkan::BufferView &SharedRDPContext::get_gamma_lut() const
+{
+	return *gamma_lut;
+}
+
+void SharedRDPContext::compile_pipeline_async(Vulkan::DeferredPipelineCompile &&compile, unsigned requests)
+{
+	std::lock_guard<std::mutex> holder{pipeline_lock};
+	if (pending_async_pipelines.count(compile.hash) == 0)
+	{
+		pending_async_pipelines.insert(compile.hash);
+		Util::Hash hash = compile.hash;
+		queued_pipelines[hash] = { std::move(compile), requests, pipeline_queue_count++ };
+		pipeline_cond.notify_one();
+	}
+	else
+	{
+		auto itr = queued_pipelines.find(compile.hash);
+		if (itr != queued_pipelines.end())
+			itr->second.requests++;
+	}
+}
+
+void SharedRDPContext::pipeline_thread_loop()
+{
+	// Avoid benign errors in logging.
+	// This thread never actually needs the thread ID.
+	Util::register_thread_index(0);
+
+	for (;;)
+	{
+		Vulkan::DeferredPipelineCompile compile;
+
+		{
+			std::unique_lock<std::mutex> holder{pipeline_lock};
+			pipeline_cond.wait(holder, [this]() { return pipeline_threads_dead || !queued_pipelines.empty(); });
+
+			// Queued pipelines are drained before shutting down, since they are persisted in the pipeline cache.
+			if (queued_pipelines.empty())
+				break;
+
+			// Only a burst of new states is queued at any time, so a linear scan is fine.
+			auto hottest = queued_pipelines.begin();
+			for (auto itr = queued_pipelines.begin(); itr != queued_pipelines.end(); ++itr)
+			{
+				auto &a = itr->second;
+				auto &b = hottest->second;
+				if (a.requests > b.requests || (a.requests == b.requests && a.order < b.order))
+					hottest = itr;
+			}
+
+			compile = std::move(hottest->second.compile);
+			queued_pipelines.erase(hottest);
+		}
+
+		auto start_ts = device.write_calibrated_timestamp();
+		Vulkan::CommandBuffer::build_compute_pipeline(&device, compile, Vulkan::CommandBuffer::CompileMode::AsyncThread);
+		auto end_ts = device.write_calibrated_timestamp();
+		device.register_time_interval("RDP Pipeline", std::move(start_ts), std::move(end_ts),
+		                              "pipeline-compilation");
+	}
+}
+
+// Layout: magic, version, variant layout hash (lo, hi), number of variants, size of pipeline cache blob,
+// variants, pipeline cache blob.
+static constexpr uint32_t PipelineCacheMagic = 0x43504452; // 'RDPC'
+static constexpr uint32_t PipelineCacheVersion = 2;
+
+// Everything which decides how the rasterizer interprets the constants of a RasterizerVariant.
+static Util::Hash hash_rasterizer_variant_layout()
+{
+	Util::Hasher h;
+	h.u32(RasterizerVariant::NumConstants);
+	h.u32(RasterizerVariant::LayoutRevision);
+	h.u32(ImplementationConstants::TileWidth);
+	h.u32(ImplementationConstants::TileHeight);
+	h.u32(sizeof(StaticRasterizationState));
+
+	static const uint32_t flag_bits[] = {
+		RASTERIZATION_INTERLACE_FIELD_BIT, RASTERIZATION_INTERLACE_KEEP_ODD_BIT,
+		RASTERIZATION_AA_BIT, RASTERIZATION_PERSPECTIVE_CORRECT_BIT,
+		RASTERIZATION_TLUT_BIT, RASTERIZATION_TLUT_TYPE_BIT,
+		RASTERIZATION_CVG_TIMES_ALPHA_BIT, RASTERIZATION_ALPHA_CVG_SELECT_BIT,
+		RASTERIZATION_MULTI_CYCLE_BIT, RASTERIZATION_TEX_LOD_ENABLE_BIT,
+		RASTERIZATION_SHARPEN_LOD_ENABLE_BIT, RASTERIZATION_DETAIL_LOD_ENABLE_BIT,
+		RASTERIZATION_FILL_BIT, RASTERIZATION_COPY_BIT,
+		RASTERIZATION_SAMPLE_MODE_BIT, RASTERIZATION_ALPHA_TEST_BIT,
+		RASTERIZATION_ALPHA_TEST_DITHER_BIT, RASTERIZATION_SAMPLE_MID_TEXEL_BIT,
+		RASTERIZATION_USES_TEXEL0_BIT, RASTERIZATION_USES_TEXEL1_BIT,
+		RASTERIZATION_USES_LOD_BIT, RASTERIZATION_USES_PIPELINED_TEXEL1_BIT,
+		RASTERIZATION_CONVERT_ONE_BIT, RASTERIZATION_BILERP_0_BIT,
+		RASTERIZATION_BILERP_1_BIT, RASTERIZATION_NEED_NOISE_DUAL_BIT,
+		RASTERIZATION_UPSCALING_LOG2_BIT_OFFSET, RASTERIZATION_NEED_NOISE_BIT,
+		RASTERIZATION_USE_STATIC_TEXTURE_SIZE_FORMAT_BIT, RASTERIZATION_USE_SPECIALIZATION_CONSTANT_BIT,
+	};
+
+	for (auto bit : flag_bits)
+		h.u32(bit);
+	return h.get();
+}
+
+template <typename Variant>
+Util::Hash SharedRDPContext::hash_variant(const Variant &variant)
+{
+	Util::Hasher h;
+	for (auto c : variant.constants)
+		h.u32(c);
+	return h.get();
+}
+
+void SharedRDPContext::register_rasterizer_variant(const RasterizerVariant &variant)
+{
+	std::lock_guard<std::mutex> holder{pipeline_lock};
+	if (rasterizer_variant_hashes.insert(hash_variant(variant)).second)
+		rasterizer_variants.push_back(variant);
+}
+
+std::vector<RasterizerVariant> SharedRDPContext::get_rasterizer_variants()
+{
+	std::lock_guard<std::mutex> holder{pipeline_lock};
+	return rasterizer_variants;
+}
+
+void SharedRDPContext::set_record_variant_usage(bool enable)
+{
+	record_usage = enable;
+}
+
+bool SharedRDPContext::is_recording_variant_usage() const
+{
+	return record_usage;
+}
+
+template <typename Variant>
+void SharedRDPContext::record_variant_usage(std::unordered_map<Util::Hash, VariantUsage<Variant>> &usage,
+                                            const Variant &variant)
+{
+	std::lock_guard<std::mutex> holder{usage_lock};
+	auto &entry = usage[hash_variant(variant)];
+	entry.variant = variant;
+	entry.dispatches++;
+}
+
+void SharedRDPContext::record_variant_usage(const RasterizerVariant &variant)
+{
+	record_variant_usage(rasterizer_usage, variant);
+}
+
+void SharedRDPContext::record_variant_usage(const DepthBlendVariant &variant)
+{
+	record_variant_usage(depth_blend_usage, variant);
+}
+
+template <typename Variant>
+std::vector<VariantUsage<Variant>> SharedRDPContext::get_variant_usage(
+		const std::unordered_map<Util::Hash, VariantUsage<Variant>> &usage)
+{
+	std::lock_guard<std::mutex> holder{usage_lock};
+	std::vector<VariantUsage<Variant>> result;
+	result.reserve(usage.size());
+	for (auto &entry : usage)
+		result.push_back(entry.second);
+
+	// Most used first.
+	std::sort(result.begin(), result.end(), [](const VariantUsage<Variant> &a, const VariantUsage<Variant> &b) {
+		return a.dispatches > b.dispatches;
+	});
+	return result;
+}
+
+std::vector<VariantUsage<RasterizerVariant>> SharedRDPContext::get_rasterizer_variant_usage()
+{
+	return get_variant_usage(rasterizer_usage);
+}
+
+std::vector<VariantUsage<DepthBlendVariant>> SharedRDPContext::get_depth_blend_variant_usage()
+{
+	return get_variant_usage(depth_blend_usage);
+}
+
+bool SharedRDPContext::load_pipeline_cache(const std::string &path)
+{
+	std::lock_guard<std::mutex> holder{pipeline_lock};
+	pipeline_cache_path = path;
+
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		LOGI("No pipeline cache found in %s, starting cold.\n", path.c_str());
+		return false;
+	}
+
+	uint32_t header[6] = {};
+	std::vector<RasterizerVariant> variants;
+	std::vector<uint8_t> blob;
+
+	long file_size = -1;
+	if (fseek(file, 0, SEEK_END) == 0)
+		file_size = ftell(file);
+	rewind(file);
+
+	bool success = fread(header, sizeof(header), 1, file) == 1 &&
+	               header[0] == PipelineCacheMagic && header[1] == PipelineCacheVersion;
+
+	Util::Hash layout_hash = hash_rasterizer_variant_layout();
+	if (success && (header[2] != uint32_t(layout_hash) || header[3] != uint32_t(layout_hash >> 32)))
+	{
+		LOGW("Pipeline cache in %s was written for a different rasterizer, ignoring it.\n", path.c_str());
+		fclose(file);
+		return false;
+	}
+
+	// Don't trust the counts before checking them against the actual file, a truncated file must not
+	// turn into a huge allocation.
+	if (success)
+	{
+		uint64_t expected_size = sizeof(header) + uint64_t(header[4]) * sizeof(RasterizerVariant) + header[5];
+		success = file_size >= 0 && uint64_t(file_size) == expected_size;
+	}
+
+	if (success)
+	{
+		variants.resize(header[4]);
+		blob.resize(header[5]);
+		success = (variants.empty() || fread(variants.data(), sizeof(RasterizerVariant), variants.size(), file) == variants.size()) &&
+		          (blob.empty() || fread(blob.data(), 1, blob.size(), file) == blob.size());
+	}
+	fclose(file);
+
+	if (!success)
+	{
+		LOGW("Pipeline cache in %s is invalid, ignoring it.\n", path.c_str());
+		return false;
+	}
+
+	// The driver validates the blob itself, so a cache from another device or driver version is merely ignored.
+	if (!blob.empty() && !device.init_pipeline_cache(blob.data(), blob.size()))
+		LOGW("Vulkan pipeline cache was rejected.\n");
+
+	for (auto &variant : variants)
+		if (rasterizer_variant_hashes.insert(hash_variant(variant)).second)
+			rasterizer_variants.push_back(variant);
+
+	LOGI("Loaded %u rasterizer variants and %u bytes of pipeline cache from %s.\n",
+	     unsigned(variants.size()), unsigned(blob.size()), path.c_str());
+	return true;
+}
+
+bool SharedRDPContext::save_pipeline_cache()
+{
+	std::lock_guard<std::mutex> holder{pipeline_lock};
+	if (pipeline_cache_path.empty())
+		return false;
+
+	std::vector<uint8_t> blob(device.get_pipeline_cache_size());
+	if (!blob.empty() && !device.get_pipeline_cache_data(blob.data(), blob.size()))
+		blob.clear();
+
+	FILE *file = fopen(pipeline_cache_path.c_str(), "wb");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing pipeline cache.\n", pipeline_cache_path.c_str());
+		return false;
+	}
+
+	Util::Hash layout_hash = hash_rasterizer_variant_layout();
+	const uint32_t header[6] = {
+		PipelineCacheMagic, PipelineCacheVersion,
+		uint32_t(layout_hash), uint32_t(layout_hash >> 32),
+		uint32_t(rasterizer_variants.size()), uint32_t(blob.size()),
+	};
+
+	bool success = fwrite(header, sizeof(header), 1, file) == 1 &&
+	               (rasterizer_variants.empty() ||
+	                fwrite(rasterizer_variants.data(), sizeof(RasterizerVariant), rasterizer_variants.size(), file) == rasterizer_variants.size()) &&
+	               (blob.empty() || fwrite(blob.data(), 1, blob.size(), file) == blob.size());
+
+	if (fclose(file) != 0)
+		success = false;
+
+	if (!success)
+		LOGE("Failed to write pipeline cache to %s.\n", pipeline_cache_path.c_str());
+	return success;
+}
+
+#ifndef PARALLEL_RDP_SHADER_DIR
+const ShaderBank *SharedRDPContext::request_shader_bank(const ResolveDefineFunc &resolve)
+{
+	std::lock_guard<std::mutex> holder{shader_bank_lock};
+
+	for (auto &variant : shader_banks)
+	{
+		bool match = true;
+		for (auto &define : variant.defines)
+		{
+			if (resolve(define.name.c_str(), define.define.c_str()) != define.value)
+			{
+				match = false;
+				break;
+			}
+		}
+
+		if (match)
+			return variant.bank.get();
+	}
+
+	ShaderBankVariant variant;
+	Vulkan::ResourceLayout layout;
+	variant.bank.reset(new ShaderBank(device, layout, [&](const char *name, const char *define) -> int {
+		int value = resolve(name, define);
+		variant.defines.push_back({ name, define, value });
+		return value;
+	}));
+
+	shader_banks.push_back(std::move(variant));
+	return shader_banks.back().bank.get();
+}
+#endif
+}
@@ -0,0 +1,173 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "device.hpp"
+#include "rdp_common.hpp"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace RDP
+{
+// Specialization constants of a rasterizer pipeline, i.e. constant IDs 2 through 7.
+struct RasterizerVariant
+{
+	enum { NumConstants = 6 };
+	// Bump whenever Renderer packs the constants differently, so stale pipeline caches are rejected.
+	enum { LayoutRevision = 1 };
+	uint32_t constants[NumConstants];
+};
+
+// Specialization constants of a depth-blend pipeline, i.e. constant IDs 0 through 7.
+struct DepthBlendVariant
+{
+	enum { NumConstants = 8 };
+	uint32_t constants[NumConstants];
+};
+
+template <typename Variant>
+struct VariantUsage
+{
+	Variant variant;
+	uint64_t dispatches = 0;
+};
+
+// Device level objects which can be shared between many CommandProcessor instances on the same Vulkan::Device,
+// i.e. shaders, the asynchronous pipeline compiler and immutable lookup tables.
+// Pipelines are cached in the shader programs, so sharing the shader bank shares compiled pipelines as well.
+// Must outlive every CommandProcessor which references it.
+class SharedRDPContext
+{
+public:
+	// Pipelines are compiled on num_pipeline_threads threads. 0 uses half the CPU cores.
+	explicit SharedRDPContext(Vulkan::Device &device, unsigned num_pipeline_threads = 0);
+	~SharedRDPContext();
+
+	SharedRDPContext(const SharedRDPContext &) = delete;
+	void operator=(const SharedRDPContext &) = delete;
+
+	Vulkan::Device &get_device() const;
+
+	const Vulkan::BufferView &get_blender_divider_lut() const;
+	const Vulkan::BufferView &get_gamma_lut() const;
+
+	// Queues up a pipeline for compilation unless it has already been requested by any processor.
+	// Requesting a pipeline again while it is still queued bumps its priority,
+	// so the pipelines which are used the most while waiting are compiled first, otherwise in queue order.
+	// Precompilation passes 0 requests, so pipelines which are actually needed go first.
+	void compile_pipeline_async(Vulkan::DeferredPipelineCompile &&compile, unsigned requests = 1);
+
+	// Loads the Vulkan pipeline cache and the rasterizer variants seen in earlier sessions from path,
+	// and saves them back to path in save_pipeline_cache() and when the context is destroyed.
+	// Processors created afterwards compile the variants in the background.
+	// Must be called before any processor is created. The PARALLEL_RDP_PIPELINE_CACHE environment variable does the same.
+	bool load_pipeline_cache(const std::string &path);
+	bool save_pipeline_cache();
+
+	// Remembers a rasterizer variant so it is precompiled in the next session.
+	void register_rasterizer_variant(const RasterizerVariant &variant);
+	std::vector<RasterizerVariant> get_rasterizer_variants();
+
+	// Counts dispatches of every pipeline variant, for offline profiling of content, see rdp-scan-variants.
+	// Must be enabled before any processor is created.
+	void set_record_variant_usage(bool enable);
+	bool is_recording_variant_usage() const;
+	void record_variant_usage(const RasterizerVariant &variant);
+	void record_variant_usage(const DepthBlendVariant &variant);
+	std::vector<VariantUsage<RasterizerVariant>> get_rasterizer_variant_usage();
+	std::vector<VariantUsage<DepthBlendVariant>> get_depth_blend_variant_usage();
+
+#ifndef PARALLEL_RDP_SHADER_DIR
+	// Shader variants depend on device capabilities and a few creation flags.
+	// A shader bank is reused if every define it was built with resolves to the same value.
+	using ResolveDefineFunc = std::function<int (const char *name, const char *define)>;
+	const ShaderBank *request_shader_bank(const ResolveDefineFunc &resolve);
+#endif
+
+private:
+	Vulkan::Device &device;
+
+	Vulkan::BufferHandle blender_divider_lut_buffer;
+	Vulkan::BufferViewHandle blender_divider_lut;
+	Vulkan::BufferHandle gamma_lut_buffer;
+	Vulkan::BufferViewHandle gamma_lut;
+
+	struct QueuedPipeline
+	{
+		Vulkan::DeferredPipelineCompile compile;
+		uint64_t requests;
+		uint64_t order;
+	};
+
+	std::mutex pipeline_lock;
+	std::condition_variable pipeline_cond;
+	std::unordered_set<Util::Hash> pending_async_pipelines;
+	std::unordered_map<Util::Hash, QueuedPipeline> queued_pipelines;
+	std::vector<std::thread> pipeline_threads;
+	uint64_t pipeline_queue_count = 0;
+	bool pipeline_threads_dead = false;
+	void pipeline_thread_loop();
+
+	std::string pipeline_cache_path;
+	std::vector<RasterizerVariant> rasterizer_variants;
+	std::unordered_set<Util::Hash> rasterizer_variant_hashes;
+	template <typename Variant>
+	static Util::Hash hash_variant(const Variant &variant);
+
+	bool record_usage = false;
+	std::mutex usage_lock;
+	std::unordered_map<Util::Hash, VariantUsage<RasterizerVariant>> rasterizer_usage;
+	std::unordered_map<Util::Hash, VariantUsage<DepthBlendVariant>> depth_blend_usage;
+
+	template <typename Variant>
+	void record_variant_usage(std::unordered_map<Util::Hash, VariantUsage<Variant>> &usage, const Variant &variant);
+	template <typename Variant>
+	std::vector<VariantUsage<Variant>> get_variant_usage(const std::unordered_map<Util::Hash, VariantUsage<Variant>> &usage);
+
+#ifndef PARALLEL_RDP_SHADER_DIR
+	struct ShaderBankVariant
+	{
+		struct Define
+		{
+			std::string name;
+			std::string define;
+			int value;
+		};
+		std::vector<Define> defines;
+		std::unique_ptr<ShaderBank> bank;
+	};
+
+	std::mutex shader_bank_lock;
+	std::vector<ShaderBankVariant> shader_banks;
+#endif
+
+	void init_luts();
+};
+}
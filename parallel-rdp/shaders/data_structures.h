@@ -311,7 +311,7 @@ struct DepthBlendState
 struct InstanceIndicesMem
 {
 	mem_u8x4 static_depth_tmem;
-	mem_u8x4 other;
+	uint noise_offset;
 	mem_u8 tile_infos[8];
 };
 
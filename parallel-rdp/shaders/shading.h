@@ -125,7 +125,8 @@ bool shade_pixel(int x, int y, uint primitive_index, out ShadedData shaded)
 	bool bilerp1 = (static_state_flags & RASTERIZATION_BILERP_1_BIT) != 0;
 
 	if ((static_state_flags & RASTERIZATION_NEED_NOISE_BIT) != 0)
-		reseed_noise(x, y, primitive_index + global_constants.fb_info.base_primitive_index);
+		reseed_noise(x, y, primitive_index + global_constants.fb_info.base_primitive_index +
+		                   state_indices.elems[primitive_index].noise_offset);
 
 	bool flip = (setup_flags & TRIANGLE_SETUP_FLIP_BIT) != 0;
 
@@ -310,7 +311,8 @@ bool shade_pixel(int x, int y, uint primitive_index, out ShadedData shaded)
 		// This only matters if both noise combiner inputs take noise (very weird).
 		if ((static_state_flags & RASTERIZATION_NEED_NOISE_DUAL_BIT) != 0)
 		{
-			reseed_noise(x + 1023, y + 7, primitive_index + global_constants.fb_info.base_primitive_index + 11);
+			reseed_noise(x + 1023, y + 7, primitive_index + global_constants.fb_info.base_primitive_index +
+			                              state_indices.elems[primitive_index].noise_offset + 11);
 			combined_inputs.noise = noise_get_combiner();
 		}
 
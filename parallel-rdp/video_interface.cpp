@@ -23,7 +23,7 @@
 #define NOMINMAX
 #include "video_interface.hpp"
 #include "rdp_renderer.hpp"
-#include "luts.hpp"
+#include "rdp_shared_context.hpp"
 #include "bitops.hpp"
 #include <cmath>
 
@@ -36,7 +36,6 @@ namespace RDP
 void VideoInterface::set_device(Vulkan::Device *device_)
 {
 	device = device_;
-	init_gamma_table();
 
 	if (const char *env = getenv("VI_DEBUG"))
 		debug_channel = strtol(env, nullptr, 0) != 0;
@@ -95,22 +94,6 @@ void VideoInterface::message(const std::string &tag, uint32_t code, uint32_t x,
 	}
 }
 
-void VideoInterface::init_gamma_table()
-{
-	Vulkan::BufferCreateInfo info = {};
-	info.domain = Vulkan::BufferDomain::Device;
-	info.size = sizeof(gamma_table);
-	info.usage = VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT;
-
-	gamma_lut = device->create_buffer(info, gamma_table);
-
-	Vulkan::BufferViewCreateInfo view = {};
-	view.buffer = gamma_lut.get();
-	view.range = sizeof(gamma_table);
-	view.format = VK_FORMAT_R8_UINT;
-	gamma_lut_view = device->create_buffer_view(view);
-}
-
 void VideoInterface::set_vi_register(VIRegister reg, uint32_t value)
 {
 	vi_registers[unsigned(reg)] = value;
@@ -133,6 +116,11 @@ void VideoInterface::set_shader_bank(const ShaderBank *bank)
 	shader_bank = bank;
 }
 
+void VideoInterface::set_shared_context(SharedRDPContext *context)
+{
+	shared_context = context;
+}
+
 static VkPipelineStageFlagBits2 layout_to_stage(VkImageLayout layout)
 {
 	switch (layout)
@@ -873,7 +861,7 @@ Vulkan::ImageHandle VideoInterface::scale_stage(Vulkan::CommandBuffer &cmd, cons
 #else
 	cmd.set_program(device->request_program(shader_bank->fullscreen, shader_bank->vi_scale));
 #endif
-	cmd.set_buffer_view(1, 0, *gamma_lut_view);
+	cmd.set_buffer_view(1, 0, shared_context->get_gamma_lut());
 	bind_horizontal_info_view(cmd, lines);
 
 	cmd.push_constants(&push, 0, sizeof(push));
@@ -89,6 +89,7 @@ struct VIScanoutBuffer
 };
 
 class Renderer;
+class SharedRDPContext;
 
 class VideoInterface : public Vulkan::DebugChannelInterface
 {
@@ -105,6 +106,7 @@ public:
 	Vulkan::ImageHandle scanout(VkImageLayout target_layout, const ScanoutOptions &options = {}, unsigned scale_factor = 1);
 	void scanout_memory_range(unsigned &offset, unsigned &length) const;
 	void set_shader_bank(const ShaderBank *bank);
+	void set_shared_context(SharedRDPContext *context);
 
 	enum PerScanlineRegisterBits
 	{
@@ -141,11 +143,9 @@ private:
 
 	const Vulkan::Buffer *rdram = nullptr;
 	const Vulkan::Buffer *hidden_rdram = nullptr;
-	Vulkan::BufferHandle gamma_lut;
-	Vulkan::BufferViewHandle gamma_lut_view;
 	const ShaderBank *shader_bank = nullptr;
+	SharedRDPContext *shared_context = nullptr;
 
-	void init_gamma_table();
 	bool previous_frame_blank = false;
 	bool debug_channel = false;
 	int filter_debug_channel_x = -1;
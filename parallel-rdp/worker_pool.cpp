@@ -0,0 +1,110 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "worker_pool.hpp"
+#include "thread_id.hpp"
+
+namespace RDP
+{
+WorkerPool::WorkerPool(unsigned num_worker_threads)
+{
+	threads.reserve(num_worker_threads);
+	for (unsigned i = 0; i < num_worker_threads; i++)
+		threads.emplace_back(&WorkerPool::worker_loop, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		dead = true;
+		work_cond.notify_all();
+	}
+
+	for (auto &thr : threads)
+		thr.join();
+}
+
+unsigned WorkerPool::get_num_threads() const
+{
+	return unsigned(threads.size()) + 1;
+}
+
+void WorkerPool::execute_jobs()
+{
+	unsigned index;
+	while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < job_count)
+		(*job)(index);
+}
+
+void WorkerPool::run(unsigned count, const std::function<void (unsigned)> &func)
+{
+	if (threads.empty() || count <= 1)
+	{
+		for (unsigned i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		job = &func;
+		job_count = count;
+		next_index.store(0, std::memory_order_relaxed);
+		pending_workers = unsigned(threads.size());
+		generation++;
+		work_cond.notify_all();
+	}
+
+	execute_jobs();
+
+	std::unique_lock<std::mutex> holder{lock};
+	done_cond.wait(holder, [this]() { return pending_workers == 0; });
+	job = nullptr;
+}
+
+void WorkerPool::worker_loop()
+{
+	// Avoid benign errors in logging.
+	// This thread never actually needs the thread ID.
+	Util::register_thread_index(0);
+
+	uint64_t current_generation = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> holder{lock};
+			work_cond.wait(holder, [&]() { return dead || generation != current_generation; });
+			if (dead)
+				break;
+			current_generation = generation;
+		}
+
+		execute_jobs();
+
+		std::lock_guard<std::mutex> holder{lock};
+		if (--pending_workers == 0)
+			done_cond.notify_one();
+	}
+}
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+namespace RDP
+{
+// A small fork-join pool for CPU work which can be split into independent items.
+// The calling thread participates in the work, so a pool with 0 worker threads is valid and runs serially.
+class WorkerPool
+{
+public:
+	explicit WorkerPool(unsigned num_worker_threads);
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool &) = delete;
+	void operator=(const WorkerPool &) = delete;
+
+	// Number of threads which execute work, including the calling thread.
+	unsigned get_num_threads() const;
+
+	// Calls func(index) for every index in [0, count), and returns when all calls have completed.
+	// Must only be called from one thread at a time.
+	void run(unsigned count, const std::function<void (unsigned)> &func);
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable work_cond;
+	std::condition_variable done_cond;
+
+	const std::function<void (unsigned)> *job = nullptr;
+	unsigned job_count = 0;
+	std::atomic_uint next_index{0};
+	unsigned pending_workers = 0;
+	uint64_t generation = 0;
+	bool dead = false;
+
+	void worker_loop();
+	void execute_jobs();
+};
+}
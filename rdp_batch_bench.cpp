@@ -0,0 +1,218 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "conformance_utils.hpp"
+#include "rdp_device.hpp"
+#include "global_managers.hpp"
+#include "global_managers_init.hpp"
+#include "cli_parser.hpp"
+#include "timer.hpp"
+#include <stdlib.h>
+
+using namespace RDP;
+
+// Forwards commands from CommandBuilder straight to a CommandProcessor, so we can read its frame statistics.
+struct ProcessorListener : CommandListenerInterface
+{
+	explicit ProcessorListener(CommandProcessor &processor_)
+		: processor(processor_)
+	{
+	}
+
+	void set_vi_register(VIRegister reg, uint32_t value) override
+	{
+		processor.set_vi_register(reg, value);
+	}
+
+	void signal_complete() override
+	{
+		processor.flush();
+	}
+
+	void command(Op, uint32_t num_words, const uint32_t *words) override
+	{
+		processor.enqueue_command(num_words, words);
+	}
+
+	void end_frame() override
+	{
+	}
+
+	void eof() override
+	{
+	}
+
+	void update_rdram(const void *, size_t, size_t) override
+	{
+	}
+
+	void update_hidden_rdram(const void *, size_t, size_t) override
+	{
+	}
+
+	CommandProcessor &processor;
+};
+
+static void print_help()
+{
+	LOGI("Usage: rdp-batch-bench [--triangles <count per frame>] [--frames <count>]\n");
+}
+
+static InputPrimitive generate_small_triangle(std::mt19937 &rnd, float size)
+{
+	std::uniform_real_distribution<float> pos(-1.0f, 1.0f - size);
+	std::uniform_real_distribution<float> col(0.0f, 1.0f);
+
+	InputPrimitive prim = {};
+	float x = pos(rnd);
+	float y = pos(rnd);
+
+	for (auto &vert : prim.vertices)
+	{
+		vert.x = x;
+		vert.y = y;
+		vert.z = col(rnd);
+		vert.w = 1.0f;
+		vert.color[0] = col(rnd);
+		vert.color[1] = col(rnd);
+		vert.color[2] = col(rnd);
+		vert.color[3] = 1.0f;
+	}
+
+	prim.vertices[1].y += size;
+	prim.vertices[2].x += size;
+	return prim;
+}
+
+static bool run_benchmark(Vulkan::Device &device, unsigned batch_size, unsigned triangles_per_frame, unsigned num_frames)
+{
+	CommandProcessorFlags flags = 0;
+	if (batch_size == 512)
+		flags |= COMMAND_PROCESSOR_FLAG_PRIMITIVE_BATCH_512_BIT;
+	else if (batch_size == 1024)
+		flags |= COMMAND_PROCESSOR_FLAG_PRIMITIVE_BATCH_1024_BIT;
+
+	CommandBuilder builder;
+	CommandProcessor processor(device, nullptr, 0, builder.get_rdram_size(), builder.get_hidden_rdram_size(), flags);
+	if (!processor.device_is_supported())
+		return false;
+
+	ProcessorListener listener(processor);
+	builder.set_command_interface(&listener);
+
+	const unsigned width = 320;
+	const unsigned height = 240;
+	builder.set_viewport({ 0, 0, float(width), float(height), 0, 1 });
+	builder.set_color_image(TextureFormat::RGBA, TextureSize::Bpp16, 0, width);
+	builder.set_depth_image(1024 * 1024);
+	builder.set_scissor(0, 0, width, height);
+	builder.set_cycle_type(CycleType::Cycle1);
+	builder.set_combiner_1cycle({{ RGBMulAdd::Zero, RGBMulSub::Zero, RGBMul::Zero, RGBAdd::Shade },
+	                             { AlphaAddSub::Zero, AlphaAddSub::Zero, AlphaMul::Zero, AlphaAddSub::ShadeAlpha }});
+	builder.set_depth_test(true);
+	builder.set_depth_write(true);
+
+	// Same scene for every batch size.
+	std::mt19937 rnd(42);
+	std::vector<InputPrimitive> prims;
+	prims.reserve(triangles_per_frame);
+	for (unsigned i = 0; i < triangles_per_frame; i++)
+		prims.push_back(generate_small_triangle(rnd, 0.05f));
+
+	uint64_t total_ns = 0;
+	uint64_t total_passes = 0;
+	const unsigned warmup_frames = 4;
+
+	for (unsigned frame = 0; frame < warmup_frames + num_frames; frame++)
+	{
+		uint64_t start_ns = Util::get_current_time_nsecs();
+		for (auto &prim : prims)
+			builder.draw_triangle(prim);
+		processor.idle();
+		uint64_t end_ns = Util::get_current_time_nsecs();
+
+		processor.begin_frame_context();
+		if (frame >= warmup_frames)
+		{
+			total_ns += end_ns - start_ns;
+			total_passes += processor.get_frame_statistics().render_passes;
+		}
+	}
+
+	LOGI("%10u | %15.2f | %15.3f\n", batch_size,
+	     double(total_passes) / double(num_frames),
+	     1e-6 * double(total_ns) / double(num_frames));
+	return true;
+}
+
+static int main_inner(int argc, char **argv)
+{
+	unsigned triangles_per_frame = 8 * 1024;
+	unsigned num_frames = 100;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--triangles", [&](Util::CLIParser &parser) { triangles_per_frame = parser.next_uint(); });
+	cbs.add("--frames", [&](Util::CLIParser &parser) { num_frames = parser.next_uint(); });
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+#ifdef _WIN32
+	_putenv("PARALLEL_RDP_FORCE_SYNC_SHADER=1");
+#else
+	setenv("PARALLEL_RDP_FORCE_SYNC_SHADER", "1", 1);
+#endif
+
+	ReplayerState state;
+	if (!state.init_common())
+		return EXIT_FAILURE;
+
+	// Frame time is measured from the first command until the GPU is idle, so it is dominated by GPU time.
+	LOGI("%u triangles per frame, %u frames.\n", triangles_per_frame, num_frames);
+	LOGI("Batch size | Passes / frame  | Frame time (ms)\n");
+	for (unsigned batch_size : { 256u, 512u, 1024u })
+	{
+		if (!run_benchmark(*state.device, batch_size, triangles_per_frame, num_frames))
+		{
+			LOGE("Failed to run benchmark with batch size %u.\n", batch_size);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	Granite::Global::init();
+	setup_filesystems();
+	int ret = main_inner(argc, argv);
+	Granite::Global::deinit();
+	return ret;
+}
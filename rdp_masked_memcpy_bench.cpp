@@ -0,0 +1,183 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "masked_memcpy.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <random>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace RDP;
+
+// The previous implementation, which issues a non-temporal masked store for every 16 bytes. Kept as a reference.
+static void reference_masked_memcpy(uint8_t * __restrict dst,
+                                    const uint8_t * __restrict data,
+                                    const uint8_t * __restrict mask,
+                                    size_t size)
+{
+#ifdef __SSE2__
+	for (size_t i = 0; i < size; i += 16)
+	{
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_maskmoveu_si128(d, m, reinterpret_cast<char *>(dst + i));
+	}
+	_mm_mfence();
+#else
+	for (size_t i = 0; i < size; i++)
+		if (mask[i])
+			dst[i] = data[i];
+#endif
+}
+
+enum class MaskPattern
+{
+	Full,
+	Empty,
+	Spans,
+	Sparse,
+	Mixed
+};
+
+static const char *pattern_name(MaskPattern pattern)
+{
+	switch (pattern)
+	{
+	case MaskPattern::Full: return "full";
+	case MaskPattern::Empty: return "empty";
+	case MaskPattern::Spans: return "spans";
+	case MaskPattern::Sparse: return "sparse";
+	case MaskPattern::Mixed: return "mixed";
+	}
+	return "";
+}
+
+static constexpr size_t PageSize = 1024;
+
+// One span of 16-bit pixels per page, like the edge of a triangle which covers part of a framebuffer line.
+static void fill_span_page(uint8_t *mask, std::mt19937 &rnd)
+{
+	size_t start = 2 * (rnd() % (PageSize / 2));
+	size_t end = start + 2 * (rnd() % ((PageSize - start) / 2 + 1));
+	memset(mask, 0, PageSize);
+	memset(mask + start, 0xff, end - start);
+}
+
+static void fill_sparse_page(uint8_t *mask, std::mt19937 &rnd)
+{
+	memset(mask, 0, PageSize);
+	for (size_t i = 0; i < PageSize; i += 2)
+		if (rnd() % 10 == 0)
+			memset(mask + i, 0xff, 2);
+}
+
+static void generate_mask(std::vector<uint8_t> &mask, MaskPattern pattern, std::mt19937 &rnd)
+{
+	for (size_t page = 0; page < mask.size(); page += PageSize)
+	{
+		uint8_t *m = mask.data() + page;
+		MaskPattern page_pattern = pattern;
+
+		// Readbacks are dominated by fully rendered pages, with some untouched and some partially covered ones.
+		if (pattern == MaskPattern::Mixed)
+		{
+			unsigned r = rnd() % 100;
+			if (r < 80)
+				page_pattern = MaskPattern::Full;
+			else if (r < 90)
+				page_pattern = MaskPattern::Empty;
+			else
+				page_pattern = MaskPattern::Spans;
+		}
+
+		switch (page_pattern)
+		{
+		case MaskPattern::Full:
+			memset(m, 0xff, PageSize);
+			break;
+		case MaskPattern::Empty:
+			memset(m, 0, PageSize);
+			break;
+		case MaskPattern::Spans:
+			fill_span_page(m, rnd);
+			break;
+		default:
+			fill_sparse_page(m, rnd);
+			break;
+		}
+	}
+}
+
+template <typename Func>
+static double measure_gb_per_sec(const Func &func, std::vector<uint8_t> &dst,
+                                 const std::vector<uint8_t> &data, const std::vector<uint8_t> &mask,
+                                 unsigned iterations)
+{
+	uint64_t start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+		func(dst.data(), data.data(), mask.data(), dst.size());
+	uint64_t end = Util::get_current_time_nsecs();
+	return double(dst.size()) * iterations / double(end - start);
+}
+
+int main(int argc, char **argv)
+{
+	// Roughly a few framebuffers worth of readback.
+	constexpr size_t size = 1024 * 1024;
+	unsigned iterations = 500;
+	if (argc > 1)
+		iterations = unsigned(strtoul(argv[1], nullptr, 0));
+
+	std::mt19937 rnd(1337);
+	std::vector<uint8_t> data(size), mask(size), dst(size), reference_dst(size);
+	for (auto &d : data)
+		d = uint8_t(rnd());
+
+	LOGI("Pattern | reference (GB/s) | masked_memcpy (GB/s)\n");
+	for (auto pattern : { MaskPattern::Full, MaskPattern::Empty, MaskPattern::Spans,
+	                      MaskPattern::Sparse, MaskPattern::Mixed })
+	{
+		generate_mask(mask, pattern, rnd);
+
+		for (size_t i = 0; i < size; i++)
+			dst[i] = reference_dst[i] = uint8_t(i);
+		reference_masked_memcpy(reference_dst.data(), data.data(), mask.data(), size);
+		masked_memcpy(dst.data(), data.data(), mask.data(), size);
+		if (dst != reference_dst)
+		{
+			LOGE("Mismatch for pattern %s.\n", pattern_name(pattern));
+			return EXIT_FAILURE;
+		}
+
+		double reference_gbs = measure_gb_per_sec(reference_masked_memcpy, reference_dst, data, mask, iterations);
+		double new_gbs = measure_gb_per_sec(masked_memcpy, dst, data, mask, iterations);
+		LOGI("%7s | %16.2f | %20.2f\n", pattern_name(pattern), reference_gbs, new_gbs);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,219 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "conformance_utils.hpp"
+#include "rdp_device.hpp"
+#include "rdp_dump.hpp"
+#include "global_managers.hpp"
+#include "global_managers_init.hpp"
+#include "cli_parser.hpp"
+#include <string.h>
+#include <stdlib.h>
+
+using namespace RDP;
+
+// Forwards a dump straight to a CommandProcessor.
+struct ProcessorListener : CommandListenerInterface
+{
+	explicit ProcessorListener(CommandProcessor &processor_)
+		: processor(processor_)
+	{
+	}
+
+	void set_vi_register(VIRegister reg, uint32_t value) override
+	{
+		processor.set_vi_register(reg, value);
+	}
+
+	void signal_complete() override
+	{
+		processor.flush();
+	}
+
+	void command(Op, uint32_t num_words, const uint32_t *words) override
+	{
+		processor.enqueue_command(num_words, words);
+	}
+
+	void end_frame() override
+	{
+		processor.idle();
+		processor.begin_frame_context();
+		frames++;
+	}
+
+	void eof() override
+	{
+		is_eof = true;
+	}
+
+	void update_rdram(const void *data, size_t size, size_t offset) override
+	{
+		processor.idle();
+		memcpy(static_cast<uint8_t *>(processor.begin_read_rdram()) + offset, data, size);
+		processor.end_write_rdram();
+	}
+
+	void update_hidden_rdram(const void *data, size_t size, size_t offset) override
+	{
+		processor.idle();
+		memcpy(static_cast<uint8_t *>(processor.begin_read_hidden_rdram()) + offset, data, size);
+		processor.end_write_hidden_rdram();
+	}
+
+	CommandProcessor &processor;
+	unsigned frames = 0;
+	bool is_eof = false;
+};
+
+static void print_help()
+{
+	LOGI("Usage: rdp-scan-variants\n"
+	     "\t<Path to dump>\n"
+	     "\t[--output <Pipeline cache>]\n"
+	     "\t[--upscaling <factor>]\n");
+}
+
+static int main_inner(int argc, char **argv)
+{
+	std::string path;
+	std::string output;
+	unsigned upscaling = 1;
+
+	Util::CLICallbacks cbs;
+	cbs.add("--help", [](Util::CLIParser &parser) { print_help(); parser.end(); });
+	cbs.add("--output", [&](Util::CLIParser &parser) { output = parser.next_string(); });
+	cbs.add("--upscaling", [&](Util::CLIParser &parser) { upscaling = parser.next_uint(); });
+	cbs.default_handler = [&](const char *arg) { path = arg; };
+	Util::CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+
+	if (!parser.parse())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (parser.is_ended_state())
+		return EXIT_SUCCESS;
+
+	if (path.empty())
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	CommandProcessorFlags flags = 0;
+	if (upscaling == 2)
+		flags |= COMMAND_PROCESSOR_FLAG_UPSCALING_2X_BIT;
+	else if (upscaling == 4)
+		flags |= COMMAND_PROCESSOR_FLAG_UPSCALING_4X_BIT;
+	else if (upscaling == 8)
+		flags |= COMMAND_PROCESSOR_FLAG_UPSCALING_8X_BIT;
+	else if (upscaling != 1)
+	{
+		LOGE("Upscaling factor must be 1, 2, 4 or 8.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Asynchronous compiles would register variants with the pipeline cache in the order they are first seen.
+	// They are registered by how often they are used instead, once the dump has been replayed.
+#ifdef _WIN32
+	_putenv("PARALLEL_RDP_FORCE_SYNC_SHADER=1");
+#else
+	setenv("PARALLEL_RDP_FORCE_SYNC_SHADER", "1", 1);
+#endif
+
+	DumpPlayer dump;
+	if (!dump.load_dump(path.c_str()))
+	{
+		LOGE("Failed to load dump: %s\n", path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	ReplayerState state;
+	if (!state.init_common())
+		return EXIT_FAILURE;
+
+	SharedRDPContext context(*state.device);
+	context.set_record_variant_usage(true);
+	if (!output.empty())
+		context.load_pipeline_cache(output);
+
+	{
+		CommandProcessor processor(context, nullptr, 0, dump.get_rdram_size(), dump.get_hidden_rdram_size(), flags);
+		if (!processor.device_is_supported())
+		{
+			LOGE("Device is not supported.\n");
+			return EXIT_FAILURE;
+		}
+
+		ProcessorListener listener(processor);
+		dump.set_command_interface(&listener);
+		while (!listener.is_eof && dump.iterate())
+		{
+		}
+		processor.idle();
+		LOGI("Replayed %u frames.\n", listener.frames);
+	}
+
+	auto rasterizer = context.get_rasterizer_variant_usage();
+	auto depth_blend = context.get_depth_blend_variant_usage();
+
+	LOGI("%u rasterizer variants:\n", unsigned(rasterizer.size()));
+	LOGI("%10s | %8s | %8s %8s %8s %8s | %8s\n", "Dispatches", "Flags", "RGB 0", "Alpha 0", "RGB 1", "Alpha 1", "Texture");
+	for (auto &usage : rasterizer)
+	{
+		auto &c = usage.variant.constants;
+		LOGI("%10llu | %08x | %08x %08x %08x %08x | %08x\n", static_cast<unsigned long long>(usage.dispatches),
+		     c[0], c[1], c[2], c[3], c[4], c[5]);
+	}
+
+	LOGI("%u depth-blend variants:\n", unsigned(depth_blend.size()));
+	LOGI("%10s | %6s | %5s | %9s | %10s | %9s | %8s\n", "Dispatches", "Format", "Alias", "Tile size", "Primitives", "Max width", "Flags");
+	for (auto &usage : depth_blend)
+	{
+		auto &c = usage.variant.constants;
+		LOGI("%10llu | %6u | %5u | %4u x %2u | %10u | %9u | %08x\n", static_cast<unsigned long long>(usage.dispatches),
+		     c[1], c[2], c[3], c[4], c[5], c[6], c[7]);
+	}
+
+	if (!output.empty())
+	{
+		// Pipelines are precompiled in registration order, so the hottest variants go first.
+		// There are only a handful of depth-blend variants, so those are not persisted.
+		for (auto &usage : rasterizer)
+			context.register_rasterizer_variant(usage.variant);
+		if (!context.save_pipeline_cache())
+			return EXIT_FAILURE;
+		LOGI("Wrote pipeline cache to %s.\n", output.c_str());
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	Granite::Global::init();
+	setup_filesystems();
+	int ret = main_inner(argc, argv);
+	Granite::Global::deinit();
+	return ret;
+}
@@ -0,0 +1,134 @@
+/* Copyright (c) 2020 Themaister
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "rdp_data_structures.hpp"
+#include "logging.hpp"
+#include "timer.hpp"
+#include <memory>
+#include <random>
+#include <vector>
+#include <stdlib.h>
+
+using namespace RDP;
+
+// The previous implementation, which scans from the back with memcmp. Kept as a reference.
+template <typename T, unsigned N>
+class LinearStateCache
+{
+public:
+	unsigned add(const T &t)
+	{
+		if (cached_index >= 0)
+			if (memcmp(&elements[cached_index], &t, sizeof(T)) == 0)
+				return unsigned(cached_index);
+
+		for (int i = int(count) - 1; i >= 0; i--)
+		{
+			if (memcmp(&elements[i], &t, sizeof(T)) == 0)
+			{
+				cached_index = i;
+				return unsigned(i);
+			}
+		}
+
+		memcpy(elements + count, &t, sizeof(T));
+		unsigned ret = count++;
+		cached_index = int(ret);
+		return ret;
+	}
+
+	void reset()
+	{
+		count = 0;
+		cached_index = -1;
+	}
+
+private:
+	unsigned count = 0;
+	int cached_index = -1;
+	T elements[N];
+};
+
+static TileInfo generate_tile_info(unsigned index)
+{
+	// Realistic tile state only differs in a few fields.
+	TileInfo info = {};
+	info.meta.offset = (index * 64) & 0xfff;
+	info.meta.stride = 8 + (index & 7) * 8;
+	info.meta.palette = index >> 6;
+	info.size.shi = 4 * (index & 63);
+	info.size.thi = 4 * (index & 31);
+	return info;
+}
+
+template <typename Cache>
+static double measure_ns_per_add(Cache &cache, const std::vector<TileInfo> &states, unsigned fill_level,
+                                 const std::vector<unsigned> &lookups, unsigned iterations)
+{
+	volatile unsigned sink = 0;
+	uint64_t start = Util::get_current_time_nsecs();
+
+	for (unsigned iter = 0; iter < iterations; iter++)
+	{
+		// Mirrors a render pass: the cache is reset, filled and then hit for every primitive.
+		cache.reset();
+		for (unsigned i = 0; i < fill_level; i++)
+			cache.add(states[i]);
+		for (auto index : lookups)
+			sink = sink + cache.add(states[index]);
+	}
+
+	uint64_t end = Util::get_current_time_nsecs();
+	(void)sink;
+	return double(end - start) / double(uint64_t(iterations) * (fill_level + lookups.size()));
+}
+
+int main(int argc, char **argv)
+{
+	constexpr unsigned N = Limits::MaxTileInfoStates;
+	constexpr unsigned num_lookups = 8 * Limits::MaxPrimitives;
+	unsigned iterations = 2000;
+	if (argc > 1)
+		iterations = unsigned(strtoul(argv[1], nullptr, 0));
+
+	std::vector<TileInfo> states(N);
+	for (unsigned i = 0; i < N; i++)
+		states[i] = generate_tile_info(i);
+
+	std::unique_ptr<StateCache<TileInfo, N>> hashed(new StateCache<TileInfo, N>);
+	std::unique_ptr<LinearStateCache<TileInfo, N>> linear(new LinearStateCache<TileInfo, N>);
+	std::mt19937 rnd(1337);
+
+	LOGI("Fill level | linear (ns / add) | hashed (ns / add)\n");
+	for (unsigned fill_level : { 1u, 8u, 32u, 64u, 128u, 192u, N })
+	{
+		std::vector<unsigned> lookups(num_lookups);
+		for (auto &index : lookups)
+			index = unsigned(rnd() % fill_level);
+
+		double linear_ns = measure_ns_per_add(*linear, states, fill_level, lookups, iterations);
+		double hashed_ns = measure_ns_per_add(*hashed, states, fill_level, lookups, iterations);
+		LOGI("%10u | %17.2f | %17.2f\n", fill_level, linear_ns, hashed_ns);
+	}
+
+	return EXIT_SUCCESS;
+}
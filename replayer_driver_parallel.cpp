@@ -24,9 +24,48 @@
 #include "device.hpp"
 #include "rdp_device.hpp"
 #include "aligned_alloc.hpp"
+#include <string.h>
+#include <algorithm>
 
 namespace RDP
 {
+// How display list commands are handed to the CommandProcessor.
+enum class SubmitMode
+{
+	// One enqueue_command() per command.
+	Command,
+	// Batched into display lists for enqueue_command_list(),
+	// interleaved with ops which alias meta commands.
+	CommandList,
+	// Written to RDRAM past what the player uses, or to a fake RSP DMEM,
+	// and fetched with process_dp_range() in ranges which split commands.
+	DPRangeRDRAM,
+	DPRangeXBus
+};
+
+static SubmitMode get_submit_mode()
+{
+	if (const char *env = getenv("PARALLEL_RDP_REPLAYER_SUBMIT"))
+	{
+		if (strcmp(env, "list") == 0)
+			return SubmitMode::CommandList;
+		else if (strcmp(env, "dp-rdram") == 0)
+			return SubmitMode::DPRangeRDRAM;
+		else if (strcmp(env, "dp-xbus") == 0)
+			return SubmitMode::DPRangeXBus;
+		else if (strcmp(env, "command") != 0)
+			LOGW("Unknown PARALLEL_RDP_REPLAYER_SUBMIT mode: %s.\n", env);
+	}
+
+	return SubmitMode::Command;
+}
+
+// RDRAM has to stay a power of two, so the display list area doubles it.
+static size_t get_rdram_scale(SubmitMode mode)
+{
+	return mode == SubmitMode::DPRangeRDRAM ? 2 : 1;
+}
+
 class ParallelReplayer : public ReplayerDriver
 {
 public:
@@ -34,8 +73,11 @@ public:
 	                 ReplayerEventInterface &iface_, bool benchmarking, bool upscale)
 		: player(player_)
 		, iface(iface_)
-		, host_memory(Util::memalign_calloc(64 * 1024, player.get_rdram_size()))
-		, gpu(device, host_memory.get(), 0, player.get_rdram_size(), player.get_hidden_rdram_size(),
+		, submit_mode(get_submit_mode())
+		, host_memory(Util::memalign_calloc(64 * 1024, player.get_rdram_size() * get_rdram_scale(submit_mode)))
+		, gpu(device, host_memory.get(), 0,
+		      player.get_rdram_size() * get_rdram_scale(submit_mode),
+		      player.get_hidden_rdram_size() * get_rdram_scale(submit_mode),
 		      (benchmarking ? 0 : (COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_HIDDEN_RDRAM_BIT | COMMAND_PROCESSOR_FLAG_HOST_VISIBLE_TMEM_BIT)) |
 		      (upscale ? COMMAND_PROCESSOR_FLAG_UPSCALING_2X_BIT : 0))
 	{
@@ -43,6 +85,17 @@ public:
 			throw std::runtime_error("GPU is not supported.");
 
 		gpu.set_validation_interface(&validation_iface);
+		gpu.set_rsp_dmem(rsp_dmem);
+
+		const char *park_env = getenv("PARALLEL_RDP_REPLAYER_PARK");
+		if (park_env && strtoul(park_env, nullptr, 0) != 0)
+		{
+			// Go idle as soon as the ring runs dry, and park until the next command.
+			CommandRingIdlePolicy policy;
+			policy.idle_kick_threshold_us = 0;
+			policy.park_timeout_us = 0;
+			gpu.set_idle_policy(policy);
+		}
 	}
 
 private:
@@ -58,6 +111,8 @@ private:
 		}
 	} validation_iface;
 
+	SubmitMode submit_mode;
+
 	struct AlignedDeleter
 	{
 		void operator()(void *ptr)
@@ -68,6 +123,11 @@ private:
 	std::unique_ptr<void, AlignedDeleter> host_memory;
 	CommandProcessor gpu;
 
+	uint32_t rsp_dmem[1024] = {};
+	std::vector<uint32_t> pending_commands;
+	unsigned meta_alias_counter = 0;
+	void flush_pending_commands();
+
 	void eof() override;
 	void signal_complete() override;
 	void update_rdram(const void *data, size_t size, size_t offset) override;
@@ -120,14 +180,49 @@ void ParallelReplayer::eof()
 	iface.eof();
 }
 
+void ParallelReplayer::flush_pending_commands()
+{
+	if (pending_commands.empty())
+		return;
+
+	if (submit_mode == SubmitMode::CommandList)
+	{
+		// Split the list in an arbitrary place, so the first span is likely to end with an incomplete command.
+		size_t consumed = gpu.enqueue_command_list(pending_commands.data(), pending_commands.size() / 2);
+		consumed += gpu.enqueue_command_list(pending_commands.data() + consumed, pending_commands.size() - consumed);
+		if (consumed != pending_commands.size())
+			LOGE("enqueue_command_list() consumed %zu of %zu words.\n", consumed, pending_commands.size());
+	}
+	else
+	{
+		bool xbus = submit_mode == SubmitMode::DPRangeXBus;
+		uint32_t base = xbus ? 0 : uint32_t(player.get_rdram_size());
+		uint32_t *memory = xbus ? rsp_dmem : static_cast<uint32_t *>(host_memory.get()) + base / sizeof(uint32_t);
+
+		// Not a multiple of any command size, so commands regularly straddle two ranges.
+		constexpr size_t RangeWords = 2 * 37;
+		for (size_t offset = 0; offset < pending_commands.size(); offset += RangeWords)
+		{
+			// Every range reuses the same memory right away, like FIFO microcode would.
+			size_t count = std::min(RangeWords, pending_commands.size() - offset);
+			memcpy(memory, pending_commands.data() + offset, count * sizeof(uint32_t));
+			gpu.process_dp_range(base, base + uint32_t(count * sizeof(uint32_t)), xbus);
+		}
+	}
+
+	pending_commands.clear();
+}
+
 void ParallelReplayer::signal_complete()
 {
+	flush_pending_commands();
 	gpu.flush();
 	iface.signal_complete();
 }
 
 void ParallelReplayer::update_rdram(const void *data, size_t size, size_t offset)
 {
+	flush_pending_commands();
 	gpu.idle();
 	memcpy(static_cast<uint8_t *>(host_memory.get()) + offset, data, size);
 	gpu.end_write_rdram();
@@ -135,18 +230,21 @@ void ParallelReplayer::update_rdram(const void *data, size_t size, size_t offset
 
 void ParallelReplayer::flush_caches()
 {
+	flush_pending_commands();
 	gpu.end_write_rdram();
 	gpu.end_write_hidden_rdram();
 }
 
 void ParallelReplayer::invalidate_caches()
 {
+	flush_pending_commands();
 	gpu.begin_read_rdram();
 	gpu.begin_read_hidden_rdram();
 }
 
 void ParallelReplayer::update_hidden_rdram(const void *data, size_t size, size_t offset)
 {
+	flush_pending_commands();
 	gpu.idle();
 	memcpy(static_cast<uint8_t *>(gpu.begin_read_hidden_rdram()) + offset, data, size);
 	gpu.end_write_hidden_rdram();
@@ -154,45 +252,59 @@ void ParallelReplayer::update_hidden_rdram(const void *data, size_t size, size_t
 
 void ParallelReplayer::command(Op command_id, uint32_t num_words, const uint32_t *words)
 {
-	gpu.enqueue_command(num_words, words);
+	if (submit_mode == SubmitMode::Command)
+		gpu.enqueue_command(num_words, words);
+	else
+	{
+		// Ops 1 to 7 must be ignored, not interpreted as meta commands.
+		uint32_t alias_op = 1 + meta_alias_counter++ % 7;
+		pending_commands.push_back(alias_op << 24);
+		pending_commands.push_back(~0u);
+		pending_commands.insert(pending_commands.end(), words, words + num_words);
+	}
 	iface.notify_command(command_id, num_words, words);
 }
 
 uint8_t *ParallelReplayer::get_rdram()
 {
+	flush_pending_commands();
 	gpu.idle();
 	return static_cast<uint8_t *>(host_memory.get());
 }
 
 size_t ParallelReplayer::get_rdram_size()
 {
-	return gpu.get_rdram_size();
+	return player.get_rdram_size();
 }
 
 uint8_t *ParallelReplayer::get_hidden_rdram()
 {
+	flush_pending_commands();
 	gpu.idle();
 	return static_cast<uint8_t *>(gpu.begin_read_hidden_rdram());
 }
 
 size_t ParallelReplayer::get_hidden_rdram_size()
 {
-	return gpu.get_hidden_rdram_size();
+	return player.get_hidden_rdram_size();
 }
 
 uint8_t *ParallelReplayer::get_tmem()
 {
+	flush_pending_commands();
 	gpu.idle();
 	return static_cast<uint8_t *>(gpu.get_tmem());
 }
 
 void ParallelReplayer::idle()
 {
+	flush_pending_commands();
 	gpu.idle();
 }
 
 void ParallelReplayer::end_frame()
 {
+	flush_pending_commands();
 	std::vector<RGBA> colors;
 	unsigned width, height;
 